@@ -0,0 +1,80 @@
+#include "bench.h"
+
+// Process execution, scheduling, logging and argument parsing costs
+int main(int argc, const char **argv) {
+  bench::Suite suite(argc, argv, "backend");
+
+  size_t n = suite.iterations(500);
+  {
+    bench::Silence silence;
+    suite.measure("call/true", n,
+                  []() { cbl::backend::call({"/bin/true"}); });
+    suite.measure("callAsync/true", n,
+                  []() { cbl::backend::callAsync({"/bin/true"}).wait(); });
+  }
+
+  for (size_t commands : {1000, 4000}) {
+    commands = suite.iterations(commands);
+    cbl::Cobbler c;
+    for (size_t i = 0; i < commands; i++) {
+      c.cmd<cbl::io::async>("/bin/true");
+    }
+    bench::Silence silence;
+    auto begin = std::chrono::steady_clock::now();
+    c();
+    suite.record("cobbler/" + std::to_string(commands) + "_async_true",
+                 commands, std::chrono::steady_clock::now() - begin);
+  }
+
+  for (size_t threads : {1, 4, 16}) {
+    size_t lines = suite.iterations(20000);
+    bench::Silence silence;
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> writers = {};
+    for (size_t t = 0; t < threads; t++) {
+      writers.emplace_back([lines]() {
+        for (size_t i = 0; i < lines; i++) {
+          COBBLER_LOG("Compiling unit: %s (%zu)", "src/some/unit.cpp", i);
+        }
+      });
+    }
+    for (auto &w : writers) {
+      w.join();
+    }
+    suite.record("log/" + std::to_string(threads) + "_threads",
+                 lines * threads, std::chrono::steady_clock::now() - begin);
+  }
+
+  for (size_t args : {100, 1000}) {
+    std::vector<std::string> storage = {"parser"};
+    for (size_t i = 0; i < 32; i++) {
+      storage.push_back("--flag-" + std::to_string(i));
+    }
+    for (size_t i = 0; i < 32; i++) {
+      storage.push_back("--value-" + std::to_string(i));
+      storage.push_back("v" + std::to_string(i));
+    }
+    while (storage.size() < args) {
+      storage.push_back("positional-" + std::to_string(storage.size()));
+    }
+    std::vector<const char *> argvs = {};
+    for (const auto &s : storage) {
+      argvs.push_back(s.c_str());
+    }
+
+    bool flags[32];
+    std::string values[32];
+    suite.measure("argparser/" + std::to_string(storage.size()) + "_args",
+                  suite.iterations(20), [&]() {
+                    cbl::util::ArgParser parser(argvs.size(), argvs.data(),
+                                                "parser");
+                    for (size_t i = 0; i < 32; i++) {
+                      parser.flag(&flags[i], "--flag-" + std::to_string(i));
+                      parser.value(&values[i],
+                                   "--value-" + std::to_string(i));
+                    }
+                    parser();
+                  });
+  }
+  suite.report();
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include "../cobbler.h"
+#include "../cobbler/util.h"
+#include <chrono>
+
+namespace bench {
+
+struct Sample {
+  std::string name;
+  size_t iterations;
+  double nsPerOp;
+};
+
+/*
+  Collects samples of one benchmark binary and reports them as JSON, either
+  to stdout or to the file given with "--output"
+*/
+struct Suite {
+  inline Suite(int argc, const char **argv, const std::string &name)
+      : _name(name) {
+    cbl::util::ArgParser parser(argc, argv, name);
+    parser
+        .opt_value(&_output, "", "--output", "-o",
+                   "file to write the JSON report to")
+        .flag(&_quick, "--quick", "-q", "run fewer iterations");
+    parser();
+  }
+
+  // Scales an iteration count down in quick mode
+  inline size_t iterations(size_t n) const {
+    return _quick ? std::max<size_t>(1, n / 10) : n;
+  }
+
+  // Runs fn once for every iteration and records the mean time per call
+  template <typename F>
+  inline void measure(const std::string &name, size_t iterations, F &&fn) {
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+      fn();
+    }
+    record(name, iterations, std::chrono::steady_clock::now() - begin);
+  }
+
+  inline void record(const std::string &name, size_t iterations,
+                     std::chrono::steady_clock::duration elapsed) {
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    _samples.push_back({name, iterations, ns / iterations});
+  }
+
+  inline void report() const {
+    std::string json = "{\"benchmark\": \"" + cbl::backend::jsonEscape(_name) +
+                       "\", \"samples\": [\n";
+    for (size_t i = 0; i < _samples.size(); i++) {
+      char line[256];
+      snprintf(line, sizeof(line),
+               "  {\"name\": \"%s\", \"iterations\": %zu, "
+               "\"ns_per_op\": %.1f}%s\n",
+               cbl::backend::jsonEscape(_samples[i].name).c_str(),
+               _samples[i].iterations, _samples[i].nsPerOp,
+               i + 1 < _samples.size() ? "," : "");
+      json += line;
+    }
+    json += "]}\n";
+
+    if (_output.empty()) {
+      fputs(json.c_str(), stdout);
+    } else {
+      std::ofstream(_output) << json;
+    }
+  }
+
+private:
+  std::string _name;
+  std::string _output;
+  bool _quick = false;
+  std::vector<Sample> _samples;
+};
+
+// Redirects stdout to /dev/null while alive, keeping log lines of the code
+// under test out of the report
+struct Silence {
+  inline Silence() {
+    fflush(stdout);
+    _saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+  }
+  inline ~Silence() {
+    fflush(stdout);
+    dup2(_saved, STDOUT_FILENO);
+    close(_saved);
+  }
+
+private:
+  int _saved;
+};
+
+} // namespace bench
@@ -0,0 +1,33 @@
+#include "bench.h"
+#include <cstring>
+
+// Compares spawn+reap latency of backend::forkAndRun and
+// backend::spawnOnUnix while the driver holds a growing amount of memory
+int main(int argc, const char **argv) {
+  bench::Suite suite(argc, argv, "spawn");
+
+  std::vector<std::string> cmd = {"true"};
+  std::vector<std::string> resolved = {
+      cbl::backend::resolveExecutable("true").value()};
+  size_t n = suite.iterations(200);
+
+  for (size_t mib : {0, 256, 1024}) {
+    size_t bytes = mib << 20;
+    std::vector<char> ballast(bytes);
+    // Touch every page so that fork has to copy the page tables
+    memset(ballast.data(), 1, bytes);
+
+    std::string suffix = "/" + std::to_string(mib) + "MiB";
+    suite.measure("fork" + suffix, n, [&]() {
+      waitpid(cbl::backend::forkAndRun(cmd), nullptr, 0);
+    });
+    // Not through launch, which registers every child's process group
+    suite.measure("spawn" + suffix, n, [&]() {
+      waitpid(std::get<1>(cbl::backend::spawnOnUnix(cmd)), nullptr, 0);
+    });
+    suite.measure("spawn_resolved" + suffix, n, [&]() {
+      waitpid(std::get<1>(cbl::backend::spawnOnUnix(resolved)), nullptr, 0);
+    });
+  }
+  suite.report();
+}
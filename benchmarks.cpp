@@ -0,0 +1,68 @@
+#include "cobbler.h"
+#include "cobbler/util.h"
+#include <cstdlib>
+#include <filesystem>
+
+int main(int argc, const char **argv) {
+  cbl::Cobbler c;
+
+  if (cbl::util::isNewerThan("benchmarks.cpp", "benchmarks")) {
+    cbl::util::rebuildAndRun(c, {"benchmarks.cpp"}, "benchmarks", argv,
+                             "-std=c++20");
+  }
+
+  std::string output;
+  bool quick = false;
+  cbl::util::ArgParser parser(argc, argv, "benchmarks");
+  parser
+      .opt_value(&output, "bench.json", "--output", "-o",
+                 "file to write the combined JSON report to")
+      .flag(&quick, "--quick", "-q", "run fewer iterations")
+      .jobs(c);
+  parser();
+
+  const std::vector<std::filesystem::path> units = {"bench/spawn.cpp",
+                                                    "bench/backend.cpp"};
+  const std::filesystem::path buildDir = "build/bench";
+  std::filesystem::create_directories(buildDir);
+
+  COBBLER_LOG("Building benchmarks");
+  COBBLER_PUSH_INDENT();
+  for (const auto &unit : units) {
+    auto object =
+        cbl::util::compile(c, unit, buildDir, "-std=c++20", "-O2", "-I.");
+    cbl::util::link(c, {object}, buildDir / unit.stem());
+  }
+  c();
+  COBBLER_POP_INDENT();
+  if (!c.failures().empty()) {
+    exit(EXIT_FAILURE);
+  }
+
+  // Benchmarks run one at a time so that they do not disturb each other
+  COBBLER_LOG("Running benchmarks");
+  c.clear();
+  std::vector<std::filesystem::path> reports = {};
+  for (const auto &unit : units) {
+    reports.push_back(buildDir / (unit.stem().string() + ".json"));
+    std::vector<std::string> command = {(buildDir / unit.stem()).string(),
+                                        "--output", reports.back().string()};
+    if (quick) {
+      command.push_back("--quick");
+    }
+    c.cmd(command);
+  }
+  c();
+  if (!c.failures().empty()) {
+    exit(EXIT_FAILURE);
+  }
+
+  std::ofstream combined(output);
+  combined << "[\n";
+  for (size_t i = 0; i < reports.size(); i++) {
+    std::ifstream report(reports[i]);
+    combined << report.rdbuf() << (i + 1 < reports.size() ? ",\n" : "");
+  }
+  combined << "]\n";
+  COBBLER_LOG("Wrote %s", output.c_str());
+}
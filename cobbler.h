@@ -1,21 +1,51 @@
 #ifndef COBBLER_H
 #define COBBLER_H
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <csignal>
+#include <chrono>
 #include <concepts>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
+#include <fcntl.h>
 #include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
 #include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <spawn.h>
 #include <sstream>
 #include <string.h>
 #include <string>
 #include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
 #include <thread>
+#include <tuple>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 // TODO: define global os-switch semantics
@@ -28,36 +58,21 @@
 #if !defined(WIN32)
 #define COBBLER_LOG(msg, ...)                                                  \
   {                                                                            \
-    std::scoped_lock printLock(cbl::backend::procMux);                         \
-    for (int i = 0; i < cbl::indentLevel; i++) {                               \
-      printf("==");                                                            \
-    }                                                                          \
-    if (cbl::indentLevel > 0) {                                                \
-      printf(" ");                                                             \
-    }                                                                          \
-    printf("\033[0;34m[INFO] ====> " msg "\033[0m\n", ##__VA_ARGS__);          \
+    cbl::backend::logger.log(cbl::backend::Logger::Level::info,                \
+                             "\033[0;34m[INFO] ====> " msg "\033[0m\n",        \
+                             ##__VA_ARGS__);                                   \
   }
 #define COBBLER_WARN(msg, ...)                                                 \
   {                                                                            \
-    std::scoped_lock printLock(cbl::backend::procMux);                         \
-    for (int i = 0; i < cbl::indentLevel; i++) {                               \
-      printf("==");                                                            \
-    }                                                                          \
-    if (cbl::indentLevel > 0) {                                                \
-      printf(" ");                                                             \
-    }                                                                          \
-    printf("\033[0;33m[WARNING] => " msg "\033[0m\n", ##__VA_ARGS__);          \
+    cbl::backend::logger.log(cbl::backend::Logger::Level::warning,             \
+                             "\033[0;33m[WARNING] => " msg "\033[0m\n",        \
+                             ##__VA_ARGS__);                                   \
   }
 #define COBBLER_ERROR(msg, ...)                                                \
   {                                                                            \
-    std::scoped_lock printLock(cbl::backend::procMux);                         \
-    for (int i = 0; i < cbl::indentLevel; i++) {                               \
-      fprintf(stderr, "==");                                                   \
-    }                                                                          \
-    if (cbl::indentLevel > 0) {                                                \
-      fprintf(stderr, " ");                                                    \
-    }                                                                          \
-    fprintf(stderr, "\033[0;31m[ERROR] ===> " msg "\033[0m\n", ##__VA_ARGS__); \
+    cbl::backend::logger.log(cbl::backend::Logger::Level::error,               \
+                             "\033[0;31m[ERROR] ===> " msg "\033[0m\n",        \
+                             ##__VA_ARGS__);                                   \
   }
 #else
 // TODO: use typical os-switch
@@ -68,34 +83,321 @@ namespace cbl {
 inline std::atomic_int indentLevel = 0;
 namespace backend {
 #ifndef COBBLER_NO_DEFAULT_BACKEND
-class ProcMux {
+/*
+  Backend of the COBBLER_* logging macros. Every line is formatted into a
+  buffer owned by the calling thread and then emitted with a single write
+  while holding an in-process lock, so lines of concurrent threads never
+  interleave. Serializing against other processes sharing the terminal
+  costs a lock file and is only done when asked for, either through
+  serializeAcrossProcesses() or by setting COBBLER_LOG_LOCK in the
+  environment.
+*/
+class Logger {
 public:
+  enum class Level : uint8_t { info = 0, warning, error };
+
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
 // TODO: implement
 #elif __ANDROID__
 // TODO: investigate if any major differences to __unix__, if not merge
 #elif __unix__
-  using native_handle_type = int;
+  inline Logger() noexcept {
+    if (getenv("COBBLER_LOG_LOCK")) {
+      serializeAcrossProcesses(true);
+    }
+  }
+  inline Logger(const Logger &) = delete;
+  ~Logger() noexcept {
+    if (_lockFile >= 0) {
+      close(_lockFile);
+    }
+  }
+
+  __attribute__((format(printf, 3, 4))) inline void
+  log(Level level, const char *format, ...) {
+    thread_local std::string buffer;
+    buffer.clear();
+    for (int i = 0; i < cbl::indentLevel; i++) {
+      buffer += "==";
+    }
+    if (cbl::indentLevel > 0) {
+      buffer += " ";
+    }
+
+    size_t prefix = buffer.size();
+    va_list args;
+    va_start(args, format);
+    va_list retry;
+    va_copy(retry, args);
+    buffer.resize(buffer.capacity() > prefix + 128 ? buffer.capacity()
+                                                   : prefix + 128);
+    int length = vsnprintf(buffer.data() + prefix, buffer.size() - prefix,
+                           format, args);
+    va_end(args);
+    if (length >= 0 && size_t(length) >= buffer.size() - prefix) {
+      buffer.resize(prefix + length + 1);
+      vsnprintf(buffer.data() + prefix, length + 1, format, retry);
+    }
+    va_end(retry);
+    buffer.resize(prefix + (length > 0 ? length : 0));
+
+    _write(level == Level::error ? stderr : stdout, buffer);
+  }
+
+  // Emits text as one block, e.g. the captured output of a command
+  inline void write(Level level, const std::string &text) {
+    if (text.empty()) {
+      return;
+    }
+    _write(level == Level::error ? stderr : stdout,
+           text.back() == '\n' ? text : text + "\n");
+  }
+
+  // Uses a lock file shared by all cobbler processes of this user
+  inline void serializeAcrossProcesses(bool enabled) {
+    std::scoped_lock lock(_mutex);
+    if (enabled && _lockFile < 0) {
+      std::string path = (std::filesystem::temp_directory_path() /
+                          ("cobbler-" + std::to_string(getuid()) + ".lock"))
+                             .string();
+      _lockFile = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    } else if (!enabled && _lockFile >= 0) {
+      close(_lockFile);
+      _lockFile = -1;
+    }
+  }
 
-  inline ProcMux() noexcept {
-    char a[] = "/tmp/COBBLER_XXXXXX_LOCK";
-    _handle = mkstemp(a);
+private:
+  inline void _write(FILE *stream, const std::string &line) {
+    std::scoped_lock lock(_mutex);
+    // Keep ordering with anything the program itself printed through stdio
+    fflush(stream);
+    if (_lockFile >= 0) {
+      flock(_lockFile, LOCK_EX);
+    }
+    const char *data = line.data();
+    size_t left = line.size();
+    while (left > 0) {
+      ssize_t written = ::write(fileno(stream), data, left);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      data += written;
+      left -= written;
+    }
+    if (_lockFile >= 0) {
+      flock(_lockFile, LOCK_UN);
+    }
   }
-  inline ProcMux(const ProcMux &) = delete;
-  ~ProcMux() noexcept { close(_handle); }
 
-  inline void lock() { flock(_handle, LOCK_EX); }
-  inline void unlock() { flock(_handle, LOCK_UN); }
-  inline bool try_lock() { return flock(_handle, LOCK_EX) == 0; }
+  std::mutex _mutex;
+  int _lockFile = -1;
 #else
 #error "Unknown target system, cannot build default backend"
 #endif
-  inline native_handle_type native_handle() { return _handle; }
+};
+inline Logger logger;
+
+inline unsigned defaultJobCount() {
+  unsigned n = std::thread::hardware_concurrency();
+  return n == 0 ? 1 : n;
+}
+
+// MemAvailable of /proc/meminfo in bytes
+inline std::optional<uint64_t> memoryAvailable() {
+  std::ifstream file("/proc/meminfo");
+  std::string key;
+  uint64_t kib;
+  while (file >> key >> kib) {
+    if (key == "MemAvailable:") {
+      return kib * 1024;
+    }
+    file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+  }
+  return {};
+}
+
+// Share of the last 10s in percent in which some task stalled on memory
+inline std::optional<double> memoryPressure() {
+  std::ifstream file("/proc/pressure/memory");
+  std::string kind, avg10;
+  if (!(file >> kind >> avg10) || kind != "some" ||
+      !avg10.starts_with("avg10=")) {
+    return {};
+  }
+  return strtod(avg10.c_str() + 6, nullptr);
+}
+
+inline std::optional<double> loadAverage() {
+  double load;
+  if (getloadavg(&load, 1) != 1) {
+    return {};
+  }
+  return load;
+}
+
+/*
+  GNU make jobserver. Every process owns one implicit job slot, further
+  slots are single byte tokens read from a pipe or fifo shared by the whole
+  process tree and written back once the job finished.
+*/
+class Jobserver {
+public:
+  inline Jobserver(const Jobserver &) = delete;
+  ~Jobserver() noexcept {
+    for (int fd : {_fd, _pipe[0], _pipe[1]}) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+
+  // Joins the jobserver of a parent make announced in MAKEFLAGS, if any
+  static inline std::unique_ptr<Jobserver> fromEnvironment() {
+    const char *flags = getenv("MAKEFLAGS");
+    if (!flags) {
+      return nullptr;
+    }
+    std::string value = {};
+    std::istringstream words(flags);
+    std::string word;
+    while (words >> word) {
+      for (const char *option : {"--jobserver-auth=", "--jobserver-fds="}) {
+        if (word.starts_with(option)) {
+          value = word.substr(strlen(option));
+        }
+      }
+    }
+    if (value.empty()) {
+      return nullptr;
+    }
+
+    std::string path = {};
+    if (value.starts_with("fifo:")) {
+      path = value.substr(5);
+    } else {
+      // A fresh open file description, so that O_NONBLOCK does not leak to
+      // the other processes sharing the pipe
+      int readFd = atoi(value.c_str());
+      if (fcntl(readFd, F_GETFD) < 0) {
+        COBBLER_WARN("Jobserver of MAKEFLAGS is not available, mark the "
+                     "recipe with '+' to share it");
+        return nullptr;
+      }
+      path = "/proc/self/fd/" + std::to_string(readFd);
+    }
+    int fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+      COBBLER_WARN("Could not open jobserver %s: %s", value.c_str(),
+                   strerror(errno));
+      return nullptr;
+    }
+    return std::unique_ptr<Jobserver>(new Jobserver(fd, value, 0));
+  }
+
+  /*
+    Creates a jobserver with slots job slots for this process tree. It is
+    announced as a pipe inherited by the children rather than a fifo, which
+    older versions of make do not understand.
+  */
+  static inline std::unique_ptr<Jobserver> serve(unsigned slots) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      COBBLER_WARN("Could not create jobserver: %s", strerror(errno));
+      return nullptr;
+    }
+    std::string path = "/proc/self/fd/" + std::to_string(fds[0]);
+    int fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+      COBBLER_WARN("Could not create jobserver: %s", strerror(errno));
+      close(fds[0]);
+      close(fds[1]);
+      return nullptr;
+    }
+    auto server = std::unique_ptr<Jobserver>(new Jobserver(
+        fd, std::to_string(fds[0]) + "," + std::to_string(fds[1]), slots));
+    server->_pipe[0] = fds[0];
+    server->_pipe[1] = fds[1];
+    for (unsigned i = 1; i < slots; i++) {
+      server->release('+');
+    }
+    return server;
+  }
+
+  inline std::optional<char> tryAcquire() {
+    char token;
+    if (read(_fd, &token, 1) == 1) {
+      return token;
+    }
+    return {};
+  }
+
+  inline void release(char token) {
+    while (::write(_fd, &token, 1) < 0 && errno == EINTR) {
+    }
+  }
+
+  // Value of --jobserver-auth, and the slot count if this process serves
+  inline const std::string &auth() const { return _auth; }
+  inline unsigned slots() const { return _slots; }
 
 private:
-  native_handle_type _handle;
+  inline Jobserver(int fd, std::string auth, unsigned slots)
+      : _fd(fd), _auth(std::move(auth)), _slots(slots) {}
+
+  int _fd;
+  std::string _auth;
+  unsigned _slots;
+  // Ends of the pipe inherited by the children when serving
+  int _pipe[2] = {-1, -1};
 };
-inline ProcMux procMux;
+
+// Outcome of a finished command
+struct Result {
+  int exitCode = 0;
+  // Interleaved stdout and stderr, only filled if the output was captured
+  std::string output = {};
+  // Resource usage of the child as reported by wait4, in seconds and KiB
+  double userTime = 0;
+  double systemTime = 0;
+  long maxRss = 0;
+  // Unset if no child was waited for, e.g. for builtins or cache hits
+  bool measured = false;
+};
+
+// Escapes s for use inside a JSON string literal
+inline std::string jsonEscape(const std::string &s) {
+  std::string result;
+  result.reserve(s.size());
+  for (char ch : s) {
+    switch (ch) {
+    case '"':
+      result += "\\\"";
+      break;
+    case '\\':
+      result += "\\\\";
+      break;
+    case '\n':
+      result += "\\n";
+      break;
+    case '\t':
+      result += "\\t";
+      break;
+    default:
+      if (uint8_t(ch) < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+        result += escaped;
+      } else {
+        result += ch;
+      }
+    }
+  }
+  return result;
+}
 
 template <std::convertible_to<std::string>... S>
 inline std::string concatenateVariadic(S const &...strings) {
@@ -122,16 +424,154 @@ inline std::vector<const char *> toLocalArglist(const std::vector<S> &cmd) {
 }
 
 #ifdef __unix__
-// TODO: Find way to run programs without having to supply a fully qualified
-// name each time
-inline std::tuple<int, pid_t> spawnOnUnix(const std::vector<std::string> &cmd) {
-  pid_t pid;
+// Looks up a program in PATH the way execvp does, caching the results until
+// PATH changes
+inline std::optional<std::string> resolveExecutable(const std::string &name) {
+  if (name.find('/') != std::string::npos) {
+    return name;
+  }
+  static std::mutex cacheMutex;
+  static std::unordered_map<std::string, std::string> cache;
+  static std::string cachedPath;
+
+  const char *env = getenv("PATH");
+  std::string path = env ? env : "/bin:/usr/bin";
+  std::scoped_lock lock(cacheMutex);
+  if (path != cachedPath) {
+    cache.clear();
+    cachedPath = path;
+  }
+  auto it = cache.find(name);
+  if (it != cache.end()) {
+    return it->second;
+  }
+
+  size_t begin = 0;
+  while (begin <= path.size()) {
+    size_t end = path.find(':', begin);
+    if (end == std::string::npos) {
+      end = path.size();
+    }
+    std::string dir = path.substr(begin, end - begin);
+    std::string candidate = (dir.empty() ? "." : dir) + "/" + name;
+    struct stat st;
+    if (access(candidate.c_str(), X_OK) == 0 &&
+        stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+      cache[name] = candidate;
+      return candidate;
+    }
+    begin = end + 1;
+  }
+  return {};
+}
+
+/*
+  Process groups of running children. Children started in a group of their
+  own can be terminated along with everything they started, but miss the
+  SIGINT of a Ctrl-C outside of the foreground group, so SIGINT, SIGTERM
+  and SIGHUP are forwarded to them unless the program handles these
+  signals itself. Lock free, as the registry is read from a signal handler.
+*/
+class ProcessGroups {
+public:
+  inline void add(pid_t group) {
+    _installHandlers();
+    for (auto &slot : _slots) {
+      pid_t empty = 0;
+      if (slot.compare_exchange_strong(empty, group)) {
+        return;
+      }
+    }
+    if (!_overflowed.exchange(true)) {
+      COBBLER_WARN("More than %zu process groups running, signals are not "
+                   "forwarded to the ones beyond",
+                   _slots.size());
+    }
+  }
+
+  inline void remove(pid_t group) {
+    for (auto &slot : _slots) {
+      pid_t expected = group;
+      if (slot.compare_exchange_strong(expected, 0)) {
+        return;
+      }
+    }
+  }
+
+  // Async-signal-safe
+  inline void signal(int sig) {
+    for (auto &slot : _slots) {
+      pid_t group = slot.load();
+      if (group > 0) {
+        kill(-group, sig);
+      }
+    }
+  }
+
+private:
+  static inline void _forward(int sig);
+
+  inline void _installHandlers() {
+    if (_installed.exchange(true)) {
+      return;
+    }
+    for (int sig : {SIGINT, SIGTERM, SIGHUP}) {
+      struct sigaction current = {};
+      if (sigaction(sig, nullptr, &current) != 0 ||
+          current.sa_handler != SIG_DFL) {
+        continue;
+      }
+      struct sigaction forward = {};
+      forward.sa_handler = _forward;
+      sigemptyset(&forward.sa_mask);
+      forward.sa_flags = SA_RESETHAND;
+      sigaction(sig, &forward, nullptr);
+    }
+  }
+
+  std::array<std::atomic<pid_t>, 1024> _slots = {};
+  std::atomic_bool _installed = false;
+  std::atomic_bool _overflowed = false;
+};
+inline ProcessGroups processGroups;
+
+inline void ProcessGroups::_forward(int sig) {
+  processGroups.signal(sig);
+  // The default action was restored by SA_RESETHAND
+  raise(sig);
+}
+
+// Starts cmd without copying the parent's address space, returns an errno
+// value and the pid of the child. If outputFd is given, the child's stdout
+// and stderr are redirected to it. Unless foreground is set, the child
+// leads a new process group.
+inline std::tuple<int, pid_t> spawnOnUnix(const std::vector<std::string> &cmd,
+                                          int outputFd = -1,
+                                          bool foreground = false) {
+  pid_t pid = -1;
+  auto program = resolveExecutable(cmd.front());
+  if (!program) {
+    return {ENOENT, pid};
+  }
   auto args = toLocalArglist(cmd);
-  int status;
 
-  return {posix_spawn(&pid, cmd.front().c_str(), nullptr, nullptr,
-                      const_cast<char *const *>(args.data()), environ),
-          pid};
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (outputFd >= 0) {
+    posix_spawn_file_actions_adddup2(&actions, outputFd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, outputFd, STDERR_FILENO);
+  }
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  if (!foreground) {
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, 0);
+  }
+  int error = posix_spawn(&pid, program->c_str(), &actions, &attributes,
+                          const_cast<char *const *>(args.data()), environ);
+  posix_spawnattr_destroy(&attributes);
+  posix_spawn_file_actions_destroy(&actions);
+  return {error, pid};
 }
 
 inline int forkAndRun(const std::vector<std::string> &cmd) {
@@ -151,121 +591,2176 @@ inline int forkAndRun(const std::vector<std::string> &cmd) {
   }
   return cPid;
 }
-#endif // __unix__
 
-inline void call(const std::vector<std::string> &cmd) {
-#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
-// TODO: implement
-#elif __ANDROID__
-// TODO: investigate if any major differences to __unix__, if not merge
-#elif __unix__
-#if 0
-  auto [status, pid] = spawnOnUnix(cmd);
-  if (status == 0) {
-    do {
-      if (waitpid(pid, &status, 0) != -1) {
-      } else {
-        COBBLER_ERROR("Encountered error while waiting for process: %s",
-                      cmd.front().c_str());
+// Starts cmd through spawnOnUnix, returns -1 if it could not be started.
+// The child's own group is registered until it is removed once reaped.
+inline pid_t launch(const std::vector<std::string> &cmd, int outputFd = -1,
+                    bool foreground = false) {
+  auto [error, pid] = spawnOnUnix(cmd, outputFd, foreground);
+  if (error != 0) {
+    COBBLER_ERROR("Failed to start process: %s because %s",
+                  cmd.front().c_str(), strerror(error));
+    return -1;
+  }
+  if (!foreground) {
+    processGroups.add(pid);
+  }
+  return pid;
+}
+
+/*
+  Reaps asynchronously started children on a single thread. On Linux every
+  child is watched through a pidfd registered with an epoll instance, along
+  with the read end of its output pipe if its output is captured. The
+  thread is started with the first watched child and joined at exit.
+  Elsewhere, or if pidfds are unavailable, each child gets its own waiter.
+*/
+class Reaper {
+public:
+  inline Reaper() = default;
+  inline Reaper(const Reaper &) = delete;
+  ~Reaper() noexcept {
+#ifdef __linux__
+    if (_thread.joinable()) {
+      _stopping = true;
+      uint64_t one = 1;
+      (void)!write(_wake, &one, sizeof(one));
+      _thread.join();
+    }
+    for (auto &[fd, child] : _children) {
+      close(fd);
+    }
+    if (_epoll >= 0) {
+      close(_epoll);
+      close(_wake);
+    }
+#endif
+  }
+
+  /*
+    Calls onExit with the raw wait status and resource usage once pid
+    exited. If outputFd is given it is drained until EOF and closed, and
+    everything read from it is passed along as well.
+  */
+  inline void
+  watch(pid_t pid, int outputFd,
+        std::function<void(int, const rusage &, std::string)> onExit) {
+#ifdef __linux__
+    int fd = int(syscall(SYS_pidfd_open, pid, 0));
+    if (fd >= 0) {
+      auto child = std::make_shared<_Child>();
+      child->pid = pid;
+      child->pidfd = fd;
+      child->outputFd = outputFd;
+      child->onExit = std::move(onExit);
+
+      std::scoped_lock lock(_mutex);
+      if (_epoll < 0) {
+        _epoll = epoll_create1(EPOLL_CLOEXEC);
+        _wake = eventfd(0, EFD_CLOEXEC);
+        epoll_event ev = {.events = EPOLLIN, .data = {.fd = _wake}};
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, _wake, &ev);
+        _thread = std::thread([this]() { _loop(); });
+      }
+      _children[fd] = child;
+      epoll_event ev = {.events = EPOLLIN, .data = {.fd = fd}};
+      epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev);
+      if (outputFd >= 0) {
+        fcntl(outputFd, F_SETFL, fcntl(outputFd, F_GETFL) | O_NONBLOCK);
+        _children[outputFd] = child;
+        epoll_event out = {.events = EPOLLIN, .data = {.fd = outputFd}};
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, outputFd, &out);
+      }
+      return;
+    }
+#endif
+    std::thread t([pid, outputFd, onExit]() {
+      std::string output = {};
+      if (outputFd >= 0) {
+        char buffer[4096];
+        ssize_t n;
+        while ((n = read(outputFd, buffer, sizeof(buffer))) != 0) {
+          if (n < 0 && errno != EINTR) {
+            break;
+          }
+          if (n > 0) {
+            output.append(buffer, n);
+          }
+        }
+        close(outputFd);
+      }
+      int status;
+      struct rusage usage = {};
+      wait4(pid, &status, 0, &usage);
+      onExit(status, usage, std::move(output));
+    });
+    t.detach();
+  }
+
+private:
+#ifdef __linux__
+  struct _Child {
+    pid_t pid;
+    int pidfd = -1;
+    int outputFd = -1;
+    int status = 0;
+    struct rusage usage = {};
+    std::string output = {};
+    std::function<void(int, const rusage &, std::string)> onExit;
+  };
+
+  inline void _loop() {
+    epoll_event events[64];
+    while (!_stopping) {
+      int n = epoll_wait(_epoll, events, 64, -1);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        COBBLER_ERROR("Reaper failed to wait for children: %s",
+                      strerror(errno));
         exit(EXIT_FAILURE);
       }
-    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-  } else {
-    COBBLER_ERROR("Failed to start process: %s because %s", cmd.front().c_str(),
-                  strerror(status));
+      for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        if (fd == _wake) {
+          continue;
+        }
+        std::shared_ptr<_Child> child;
+        {
+          std::scoped_lock lock(_mutex);
+          auto it = _children.find(fd);
+          if (it == _children.end()) {
+            continue;
+          }
+          child = it->second;
+        }
+
+        if (fd == child->outputFd) {
+          if (!_drain(*child)) {
+            continue;
+          }
+          child->outputFd = -1;
+        } else {
+          wait4(child->pid, &child->status, 0, &child->usage);
+          child->pidfd = -1;
+        }
+        _forget(fd);
+        if (child->pidfd < 0 && child->outputFd < 0) {
+          child->onExit(child->status, child->usage,
+                        std::move(child->output));
+        }
+      }
+    }
   }
-#endif
 
-  pid_t cPid = forkAndRun(cmd);
-  int status;
-  waitpid(cPid, &status, 0);
-  if (!(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
-    auto errorval = errno;
-    COBBLER_ERROR("Command %s encountered an error", cmd.front().c_str());
+  // Reads everything available, returns true once EOF was reached
+  static inline bool _drain(_Child &child) {
+    char buffer[16384];
+    while (true) {
+      ssize_t n = read(child.outputFd, buffer, sizeof(buffer));
+      if (n > 0) {
+        child.output.append(buffer, n);
+      } else if (n < 0 && errno == EINTR) {
+        continue;
+      } else {
+        return n == 0 || errno != EAGAIN;
+      }
+    }
+  }
+
+  inline void _forget(int fd) {
+    std::scoped_lock lock(_mutex);
+    _children.erase(fd);
+    epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
   }
+
+  std::mutex _mutex;
+  std::unordered_map<int, std::shared_ptr<_Child>> _children;
+  std::thread _thread;
+  std::atomic_bool _stopping = false;
+  int _epoll = -1;
+  int _wake = -1;
+#endif
+};
+inline Reaper reaper;
+#endif // __unix__
+
+/*
+  Filesystem operations behind the builtins of Cobbler, they return 0 or an
+  errno value instead of spawning the equivalent coreutils.
+*/
+inline int removePath(const std::filesystem::path &path) {
+  std::error_code ec;
+  std::filesystem::remove_all(path, ec);
+  return ec.value();
 }
 
-#else
-#error "Unknown target system, cannot build default backend"
+inline int makeDirectory(const std::filesystem::path &path) {
+  std::error_code ec;
+  std::filesystem::create_directories(path, ec);
+  return ec.value();
+}
+
+// Copies the content of in to out from their current offsets
+inline int copyData(int in, int out, off_t size) {
+#ifdef __linux__
+  // Shares the extents on filesystems supporting reflinks
+  if (ioctl(out, FICLONE, in) == 0) {
+    return 0;
+  }
+  off_t left = size;
+  while (left > 0) {
+    ssize_t copied = copy_file_range(in, nullptr, out, nullptr, left, 0);
+    if (copied <= 0) {
+      break;
+    }
+    left -= copied;
+  }
+  if (left == 0) {
+    return 0;
+  }
 #endif
+  char buffer[1 << 16];
+  ssize_t count;
+  while ((count = read(in, buffer, sizeof(buffer))) > 0) {
+    for (ssize_t written = 0; written < count;) {
+      ssize_t n = ::write(out, buffer + written, count - written);
+      if (n < 0) {
+        return errno;
+      }
+      written += n;
+    }
+  }
+  return count < 0 ? errno : 0;
+}
 
-  inline std::future<void> callAsync(const std::vector<std::string> &cmd) {
-#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
-// TODO: implement
-#elif __ANDROID__
-// TODO: investigate if any major differences to __unix__, if not merge
-#elif __unix__
-  pid_t cPid = forkAndRun(cmd);
-  /* PARENT */
-  std::promise<void> wait_promise;
-  std::future<void> wait_future = wait_promise.get_future();
-  std::thread t(
-      [cPid, cmd](std::promise<void> wp) {
-        int status;
-        waitpid(cPid, &status, 0);
-        if (!(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
-          auto errorval = errno;
-          COBBLER_ERROR("Command %s encountered an error", cmd.front().c_str());
-        }
-        wp.set_value();
-      },
-      std::move(wait_promise));
-  t.detach();
-  return wait_future;
+/*
+  Copies the regular file from to to, keeping its permissions and creating
+  the parent directories of to. The copy is written next to to and renamed
+  over it, so readers never see a partial file.
+*/
+inline int copyFile(const std::filesystem::path &from,
+                    const std::filesystem::path &to) {
+  int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return errno;
+  }
+  struct stat st;
+  if (fstat(in, &st) != 0) {
+    int error = errno;
+    close(in);
+    return error;
+  }
+  if (to.has_parent_path()) {
+    std::error_code ec;
+    std::filesystem::create_directories(to.parent_path(), ec);
+  }
+  std::string tmp = to.string() + ".tmp." + std::to_string(getpid());
+  int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 st.st_mode & 07777);
+  if (out < 0) {
+    int error = errno;
+    close(in);
+    return error;
+  }
+  int error = copyData(in, out, st.st_size);
+  close(in);
+  if (close(out) != 0 && error == 0) {
+    error = errno;
+  }
+  if (error == 0 && rename(tmp.c_str(), to.c_str()) != 0) {
+    error = errno;
+  }
+  if (error != 0) {
+    unlink(tmp.c_str());
+  }
+  return error;
+}
+
+// Copies a file, or a directory recursively
+inline int copyPath(const std::filesystem::path &from,
+                    const std::filesystem::path &to) {
+  std::error_code ec;
+  if (!std::filesystem::is_directory(from, ec)) {
+    return copyFile(from, to);
+  }
+  for (auto it = std::filesystem::recursive_directory_iterator(from, ec);
+       !ec && it != std::filesystem::recursive_directory_iterator();
+       it.increment(ec)) {
+    std::filesystem::path target =
+        to / std::filesystem::relative(it->path(), from);
+    int error = it->is_directory(ec) ? makeDirectory(target)
+                                     : copyFile(it->path(), target);
+    if (error != 0) {
+      return error;
+    }
+  }
+  return ec.value();
+}
+
+// Points link to target, replacing whatever link was
+inline int makeSymlink(const std::filesystem::path &target,
+                       const std::filesystem::path &link) {
+  std::error_code ec;
+  if (link.has_parent_path()) {
+    std::filesystem::create_directories(link.parent_path(), ec);
+  }
+  std::filesystem::remove(link, ec);
+  std::filesystem::create_symlink(target, link, ec);
+  return ec.value();
+}
+
+// Leaves path untouched if it already holds content, keeping its mtime
+inline int writeFile(const std::filesystem::path &path,
+                     const std::string &content) {
+  std::error_code ec;
+  if (std::filesystem::file_size(path, ec) == content.size() && !ec) {
+    std::ifstream existing(path, std::ios::binary);
+    std::string previous((std::istreambuf_iterator<char>(existing)),
+                         std::istreambuf_iterator<char>());
+    if (previous == content) {
+      return 0;
+    }
+  }
+  if (path.has_parent_path()) {
+    std::filesystem::create_directories(path.parent_path(), ec);
+  }
+  std::string tmp = path.string() + ".tmp." + std::to_string(getpid());
+  {
+    std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+    if (!file.write(content.data(), content.size()).flush()) {
+      unlink(tmp.c_str());
+      return EIO;
+    }
+  }
+  if (rename(tmp.c_str(), path.c_str()) != 0) {
+    int error = errno;
+    unlink(tmp.c_str());
+    return error;
+  }
+  return 0;
+}
+
+// Metadata of a file as needed by up-to-date checks
+struct FileStat {
+  bool exists = false;
+  // Modification time in nanoseconds since the epoch
+  int64_t mtime = 0;
+  uint64_t size = 0;
+  mode_t mode = 0;
+};
+
+inline FileStat statFile(const std::filesystem::path &path) {
+#ifdef STATX_BASIC_STATS
+  struct statx stx;
+  if (statx(AT_FDCWD, path.c_str(), 0, STATX_TYPE | STATX_MODE |
+                                           STATX_MTIME | STATX_SIZE,
+            &stx) != 0) {
+    return {};
+  }
+  return {.exists = true,
+          .mtime = int64_t(stx.stx_mtime.tv_sec) * 1000000000 +
+                   stx.stx_mtime.tv_nsec,
+          .size = stx.stx_size,
+          .mode = stx.stx_mode};
 #else
-#error "Unknown target system, cannot build default backend"
-#endif
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return {};
   }
+  return {.exists = true,
+          .mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 +
+                   st.st_mtim.tv_nsec,
+          .size = uint64_t(st.st_size),
+          .mode = st.st_mode};
 #endif
-} // namespace backend
-} // namespace cbl
+}
 
-namespace cbl {
-enum class io : uint8_t { sync = 0, async };
-struct Cobbler {
-  inline void operator()() {
-    std::vector<std::future<void>> unfinished = {};
-    for (_Command &c : _commands) {
-      COBBLER_LOG("Executing %s command: %s",
-                  c.calltype == io::async ? "asynchronous" : "synchronous",
-                  c.call.front().c_str());
-      if (c.calltype == io::sync) {
-        backend::call(c.call);
-      } else {
-        unfinished.push_back(backend::callAsync(c.call));
+// 64-bit FNV-1a of the content of path, empty if it cannot be read
+inline std::optional<uint64_t> hashContent(const std::filesystem::path &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return {};
+  }
+  uint64_t hash = 0xcbf29ce484222325;
+  unsigned char buffer[1 << 16];
+  ssize_t count;
+  while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+    for (ssize_t i = 0; i < count; i++) {
+      hash = (hash ^ buffer[i]) * 0x100000001b3;
+    }
+  }
+  close(fd);
+  if (count < 0) {
+    return {};
+  }
+  return hash;
+}
+
+/*
+  Cache of FileStat for up-to-date checks, so a file shared by many checks
+  (headers) is only stat'ed once. Cobbler clears it at the start and end
+  of every run and drops the declared outputs of each command as it
+  finishes, code writing files outside of commands calls invalidate().
+*/
+class StatCache {
+public:
+  inline FileStat get(const std::filesystem::path &path) {
+    std::string key = _key(path);
+    {
+      std::scoped_lock lock(_mutex);
+      auto it = _entries.find(key);
+      if (it != _entries.end()) {
+        return it->second;
+      }
+    }
+    FileStat st = statFile(path);
+    std::scoped_lock lock(_mutex);
+    _entries[key] = st;
+    return st;
+  }
+
+  /*
+    Looks up many paths at once, the ones not cached yet are stat'ed spread
+    over threads if there are enough of them to pay off.
+  */
+  inline std::vector<FileStat>
+  get(const std::vector<std::filesystem::path> &paths) {
+    std::vector<FileStat> stats(paths.size());
+    std::vector<std::string> keys(paths.size());
+    std::vector<size_t> missing = {};
+    {
+      std::scoped_lock lock(_mutex);
+      for (size_t i = 0; i < paths.size(); i++) {
+        keys[i] = _key(paths[i]);
+        auto it = _entries.find(keys[i]);
+        if (it != _entries.end()) {
+          stats[i] = it->second;
+        } else {
+          missing.push_back(i);
+        }
+      }
+    }
+    if (missing.empty()) {
+      return stats;
+    }
+    size_t threads = std::min<size_t>(defaultJobCount(), missing.size() / 256);
+    size_t stride = std::max<size_t>(threads, 1);
+    auto work = [&](size_t first) {
+      for (size_t m = first; m < missing.size(); m += stride) {
+        stats[missing[m]] = statFile(paths[missing[m]]);
+      }
+    };
+    if (threads <= 1) {
+      work(0);
+    } else {
+      std::vector<std::thread> pool = {};
+      for (size_t t = 0; t < threads; t++) {
+        pool.emplace_back(work, t);
+      }
+      for (auto &t : pool) {
+        t.join();
       }
     }
-    for (auto &f : unfinished) {
-      f.wait();
+    std::scoped_lock lock(_mutex);
+    for (size_t i : missing) {
+      _entries[keys[i]] = stats[i];
     }
-    COBBLER_LOG("Waiting for all commands to finish");
+    return stats;
   }
 
-  inline void clear() { _commands.clear(); }
+  // Fills the cache ahead of lookups, e.g. with every input of a build
+  inline void prefetch(const std::vector<std::filesystem::path> &paths) {
+    get(paths);
+  }
 
-  template <io TYPE = io::sync, typename... S>
-  inline Cobbler &cmd(S const &...command) {
-    _commands.push_back(
-        {.calltype = TYPE,
-         .call = backend::splatVariadicToArgVector(command...)});
-    return (*this);
+  // Drops path, whether it was looked up relative or absolute
+  inline void invalidate(const std::filesystem::path &path) {
+    std::error_code ec;
+    std::filesystem::path cwd = std::filesystem::current_path(ec);
+    std::filesystem::path absolute = (cwd / path).lexically_normal();
+    std::filesystem::path relative = absolute.lexically_relative(cwd);
+    std::scoped_lock lock(_mutex);
+    _entries.erase(absolute.string());
+    if (!relative.empty()) {
+      _entries.erase(relative.string());
+    }
   }
 
-  template <io TYPE = io::sync>
-  inline Cobbler &cmd(const std::vector<std::string> &command) {
-    _commands.push_back({.calltype = TYPE, .call = command});
-    return (*this);
+  inline void clear() {
+    std::scoped_lock lock(_mutex);
+    _entries.clear();
   }
 
 private:
-  struct _Command {
-    io calltype;
-    std::vector<std::string> call;
-  };
+  // Normalized path, checked first as the lookup is hot
+  static inline std::string _key(const std::filesystem::path &path) {
+    const std::string &p = path.native();
+    bool normal = p.find("//") == std::string::npos &&
+                  p.find("/./") == std::string::npos &&
+                  p.find("/../") == std::string::npos &&
+                  !p.starts_with("./") && !p.starts_with("../") &&
+                  !p.ends_with("/.") && !p.ends_with("/..") && p != "." &&
+                  p != "..";
+    return normal ? p : path.lexically_normal().string();
+  }
 
-  std::vector<_Command> _commands;
-  std::atomic_int _asyncCounter;
-  std::atomic_int _completedAsyncs;
+  std::mutex _mutex;
+  std::unordered_map<std::string, FileStat> _entries;
+};
+inline StatCache statCache;
+
+// Exit code of a waited-for child, 128 + signal number if it was killed
+inline int exitCode(int status) {
+  if (WIFEXITED(status)) {
+    return WEXITSTATUS(status);
+  }
+  return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : EXIT_FAILURE;
+}
+
+// Runs cmd in the foreground process group, where it can read the terminal
+// and gets the signals of a Ctrl-C, and waits for it
+inline int call(const std::vector<std::string> &cmd) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+// TODO: implement
+#elif __ANDROID__
+// TODO: investigate if any major differences to __unix__, if not merge
+#elif __unix__
+  pid_t cPid = launch(cmd, -1, true);
+  if (cPid < 0) {
+    return 127;
+  }
+  int status;
+  waitpid(cPid, &status, 0);
+  if (!(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+    auto errorval = errno;
+    COBBLER_ERROR("Command %s encountered an error", cmd.front().c_str());
+  }
+  return exitCode(status);
+}
+
+#else
+#error "Unknown target system, cannot build default backend"
+#endif
+
+  /*
+    Starts cmd and returns immediately, onExit is called from the reaper
+    once it finished. With capture set, stdout and stderr of the child are
+    collected into Result::output instead of being inherited. onStart gets
+    the pid of the child before onExit can be called. With foreground set
+    the child stays in the foreground process group instead of leading its
+    own, see launch.
+  */
+  inline std::future<void>
+  callAsync(const std::vector<std::string> &cmd,
+            std::function<void(const Result &)> onExit = {},
+            bool capture = false,
+            std::function<void(pid_t)> onStart = {},
+            bool foreground = false) {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+// TODO: implement
+#elif __ANDROID__
+// TODO: investigate if any major differences to __unix__, if not merge
+#elif __unix__
+  int output[2] = {-1, -1};
+  if (capture && pipe2(output, O_CLOEXEC) != 0) {
+    COBBLER_WARN("Could not capture output of %s: %s", cmd.front().c_str(),
+                 strerror(errno));
+    output[0] = output[1] = -1;
+  }
+  pid_t cPid = launch(cmd, output[1], foreground);
+  if (output[1] >= 0) {
+    close(output[1]);
+  }
+  auto wait_promise = std::make_shared<std::promise<void>>();
+  std::future<void> wait_future = wait_promise->get_future();
+  if (cPid < 0) {
+    if (output[0] >= 0) {
+      close(output[0]);
+    }
+    if (onExit) {
+      onExit({.exitCode = 127});
+    }
+    wait_promise->set_value();
+    return wait_future;
+  }
+  if (onStart) {
+    onStart(cPid);
+  }
+  reaper.watch(
+      cPid, output[0],
+      [cPid, onExit, wait_promise](int status, const rusage &usage,
+                                   std::string output) {
+        processGroups.remove(cPid);
+        if (onExit) {
+          auto seconds = [](const timeval &t) {
+            return double(t.tv_sec) + double(t.tv_usec) / 1e6;
+          };
+          onExit({.exitCode = exitCode(status),
+                  .output = std::move(output),
+                  .userTime = seconds(usage.ru_utime),
+                  .systemTime = seconds(usage.ru_stime),
+                  .maxRss = usage.ru_maxrss,
+                  .measured = true});
+        }
+        wait_promise->set_value();
+      });
+  return wait_future;
+#else
+#error "Unknown target system, cannot build default backend"
+#endif
+  }
+#endif
+} // namespace backend
+} // namespace cbl
+
+namespace cbl {
+enum class io : uint8_t { sync = 0, async };
+struct Cobbler {
+  // Refers to a command previously added to this Cobbler
+  struct Handle {
+    size_t index;
+  };
+  /*
+    Declared edges of a command, a command is started as soon as every
+    command in "after" and every command producing one of its "inputs" has
+    finished. Without any declared edges commands keep their flat-list
+    semantics: each command waits for the last io::sync command before it.
+  */
+  struct Edges {
+    std::vector<Handle> after = {};
+    std::vector<std::filesystem::path> inputs = {};
+    std::vector<std::filesystem::path> outputs = {};
+  };
+  /*
+    Limits checked before starting another command while others are still
+    running, on top of jobs(). They look at the whole machine, so work
+    outside of this build is accounted for as well.
+  */
+  struct Admission {
+    // Memory to leave available after the estimated peak of the commands
+    // being started, estimates are learned through history()
+    uint64_t reserve = uint64_t(1) << 30;
+    // Upper bound on the share of time tasks stalled on memory, in percent
+    double maxMemoryPressure = 10.0;
+    // Upper bound on the load average not caused by this build, 0 for the
+    // hardware concurrency
+    double maxLoad = 0.0;
+  };
+  // A command that exited with a non-zero code during the last run
+  struct Failure {
+    std::vector<std::string> call;
+    backend::Result result;
+  };
+  // Outcome of a run, returned by operator()
+  struct Run {
+    size_t succeeded = 0;
+    std::vector<Failure> failures = {};
+    // Not started as a command they depend on failed
+    size_t skipped = 0;
+    // Not started or terminated as the run was stopped or cancelled
+    size_t stopped = 0;
+    // Not started as they were up to date, see restat()
+    size_t upToDate = 0;
+    // Failed while awaited by a task, which owns the failure, see run()
+    size_t handled = 0;
+
+    inline bool ok() const {
+      return failures.empty() && skipped == 0 && stopped == 0;
+    }
+  };
+  /*
+    Coroutine driven by the scheduler of a Cobbler, started with spawn(). It
+    may co_await commands through run() and other tasks, and is only ever
+    resumed by the thread inside operator(): waiting on a command costs a
+    suspended frame, not a thread. An exception escaping a task is rethrown
+    in the task awaiting it, or by operator() once the run stopped.
+  */
+  class Task {
+  public:
+    struct promise_type {
+      std::coroutine_handle<> continuation = {};
+      std::exception_ptr exception = {};
+
+      inline Task get_return_object() {
+        return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+      }
+      inline std::suspend_always initial_suspend() noexcept { return {}; }
+      inline auto final_suspend() noexcept {
+        // Resumes the task awaiting this one, if any
+        struct Continue {
+          inline bool await_ready() noexcept { return false; }
+          inline std::coroutine_handle<>
+          await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+            auto next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+          }
+          inline void await_resume() noexcept {}
+        };
+        return Continue{};
+      }
+      inline void return_void() {}
+      inline void unhandled_exception() {
+        exception = std::current_exception();
+      }
+    };
+
+    inline Task(Task &&other) noexcept
+        : _handle(std::exchange(other._handle, {})) {}
+    inline Task(const Task &) = delete;
+    ~Task() noexcept {
+      if (_handle) {
+        _handle.destroy();
+      }
+    }
+
+    // Runs the task to completion before continuing the awaiting one
+    inline auto operator co_await() && noexcept {
+      struct Awaiter {
+        std::coroutine_handle<promise_type> handle;
+
+        inline bool await_ready() noexcept {
+          return !handle || handle.done();
+        }
+        inline std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<> caller) noexcept {
+          handle.promise().continuation = caller;
+          return handle;
+        }
+        inline void await_resume() {
+          if (handle && handle.promise().exception) {
+            std::rethrow_exception(handle.promise().exception);
+          }
+        }
+      };
+      return Awaiter{_handle};
+    }
+
+  private:
+    friend struct Cobbler;
+    inline explicit Task(std::coroutine_handle<promise_type> h) : _handle(h) {}
+
+    std::coroutine_handle<promise_type> _handle;
+  };
+
+  ~Cobbler() noexcept {
+    for (auto task : _newTasks) {
+      task.destroy();
+    }
+    for (auto task : _tasks) {
+      task.destroy();
+    }
+  }
+
+  inline Run operator()() {
+    {
+      std::scoped_lock lock(_doneMutex);
+      _active = true;
+      _cancelled = false;
+      _runs++;
+      _startSignal.notify_all();
+    }
+    _failures.clear();
+    // The trace is rewritten by every run and covers that run only
+    _traceEvents.clear();
+    _traceEpoch = std::chrono::steady_clock::now();
+    backend::statCache.clear();
+    Run run = {};
+    // Set once stopAfter() failures were reached
+    bool stopping = false;
+    std::vector<bool> skipped(_commands.size(), false);
+    std::vector<_Timing> timings(_commands.size());
+    std::vector<bool> lanes = {};
+    std::vector<std::vector<size_t>> dependents(_commands.size());
+    std::vector<size_t> pending(_commands.size(), 0);
+    std::optional<size_t> lastSync = _resolveEdges(dependents, pending);
+    // Outcomes so far, to resolve edges of commands added by tasks
+    std::vector<bool> settled(_commands.size(), false);
+    std::vector<bool> failed(_commands.size(), false);
+    // Set once a command it waited for changed its outputs, see restat()
+    std::vector<bool> changed(_commands.size(), false);
+
+    // Ready commands on the longest remaining path start first
+    std::vector<double> priority = _criticalPaths(dependents, pending);
+    auto later = [&priority](size_t a, size_t b) {
+      return priority[a] != priority[b] ? priority[a] < priority[b] : a > b;
+    };
+    std::vector<size_t> ready = {};
+    for (size_t i = 0; i < _commands.size(); i++) {
+      if (pending[i] == 0) {
+        ready.push_back(i);
+      }
+    }
+    std::make_heap(ready.begin(), ready.end(), later);
+
+    std::vector<uint64_t> memory = _memoryEstimates();
+    uint64_t claimed = 0;
+    bool held = false;
+
+    // Commands beyond the implicit slot of this process take a token
+    std::optional<std::string> makeflags = _joinJobserver();
+    std::vector<std::optional<char>> tokens(_commands.size());
+    bool implicitSlot = true;
+    bool starved = false;
+
+    // Depth and running commands of each pool, -1 for commands in none
+    std::vector<long> poolOf = {};
+    std::vector<std::pair<unsigned, unsigned>> pools = {};
+    std::unordered_map<std::string, long> poolIndex = {};
+    auto poolFor = [&](size_t i) -> long {
+      const std::string &name = _commands[i].pool;
+      if (name.empty()) {
+        return -1;
+      }
+      auto declared = _pools.find(name);
+      if (declared == _pools.end()) {
+        COBBLER_ERROR("Command %s uses undeclared pool %s",
+                      _commands[i].call.front().c_str(), name.c_str());
+        exit(EXIT_FAILURE);
+      }
+      auto [it, inserted] = poolIndex.try_emplace(name, pools.size());
+      if (inserted) {
+        pools.push_back({declared->second, 0});
+      }
+      return it->second;
+    };
+    for (size_t i = 0; i < _commands.size(); i++) {
+      poolOf.push_back(poolFor(i));
+    }
+
+    size_t running = 0;
+    size_t finished = 0;
+
+    auto release = [&](size_t i, bool outputsChanged) {
+      for (size_t d : dependents[i]) {
+        if (outputsChanged) {
+          changed[d] = true;
+        }
+        if (--pending[d] == 0) {
+          ready.push_back(d);
+          std::push_heap(ready.begin(), ready.end(), later);
+        }
+      }
+    };
+
+    // Tasks resumed by finished commands, and results of skipped awaits
+    std::vector<std::coroutine_handle<>> resumable = {};
+    auto skip = [&](const std::vector<size_t> &commands) {
+      finished += commands.size();
+      for (size_t d : commands) {
+        if (_commands[d].awaiting) {
+          *_commands[d].result = {.exitCode = -1};
+          resumable.push_back(_commands[d].awaiting);
+        }
+      }
+    };
+    // Adds the commands tasks added during the run to the schedule
+    size_t known = _commands.size();
+    auto integrate = [&]() {
+      for (size_t i = known; i < _commands.size(); i++) {
+        timings.emplace_back();
+        dependents.emplace_back();
+        tokens.emplace_back();
+        settled.push_back(false);
+        failed.push_back(false);
+        changed.push_back(false);
+        skipped.push_back(false);
+        memory.push_back(_memoryEstimate(i));
+        priority.push_back(_durationEstimate(i, _averageDuration()));
+        poolOf.push_back(poolFor(i));
+        size_t count = 0;
+        bool blocked = false;
+        for (size_t d : _dependencies(i, lastSync)) {
+          if (skipped[d] || failed[d]) {
+            blocked = true;
+          } else if (!settled[d]) {
+            dependents[d].push_back(i);
+            count++;
+          }
+        }
+        pending.push_back(count);
+        if (_commands[i].calltype == io::sync) {
+          lastSync = i;
+        }
+        if (blocked) {
+          skipped[i] = true;
+          std::vector<size_t> skippedNow = {i};
+          for (size_t d : _skipDependents(i, dependents, skipped)) {
+            skippedNow.push_back(d);
+          }
+          skip(skippedNow);
+        } else if (count == 0) {
+          ready.push_back(i);
+          std::push_heap(ready.begin(), ready.end(), later);
+        }
+      }
+      known = _commands.size();
+    };
+    // First exception escaping a task, the run stops and rethrows it
+    std::exception_ptr taskException = {};
+    // Runs tasks until they wait for commands again
+    auto advance = [&]() {
+      while (!resumable.empty() || !_newTasks.empty()) {
+        std::vector<std::coroutine_handle<>> now = {};
+        now.swap(resumable);
+        for (auto task : _newTasks) {
+          _tasks.push_back(task);
+          now.push_back(task);
+        }
+        _newTasks.clear();
+        for (auto task : now) {
+          task.resume();
+          integrate();
+        }
+      }
+      integrate();
+      for (auto task : _tasks) {
+        if (!taskException && task.done() && task.promise().exception) {
+          COBBLER_ERROR("Task failed with an exception, stopping");
+          taskException = task.promise().exception;
+          stopping = true;
+          _terminateRunning();
+        }
+      }
+    };
+    advance();
+
+    while (finished < _commands.size()) {
+      held = false;
+      starved = false;
+      // Commands of full pools wait aside, without blocking other commands
+      std::vector<size_t> full = {};
+      while (!ready.empty() && running < _jobs && !_cancelled && !stopping) {
+        std::pop_heap(ready.begin(), ready.end(), later);
+        size_t i = ready.back();
+        ready.pop_back();
+        if (!changed[i] && _commands[i].upToDate &&
+            _commands[i].upToDate()) {
+          COBBLER_LOG("Up to date: %s", _commands[i].call.front().c_str());
+          finished++;
+          settled[i] = true;
+          run.upToDate++;
+          release(i, false);
+          continue;
+        }
+        if (poolOf[i] >= 0 &&
+            pools[poolOf[i]].second >= pools[poolOf[i]].first) {
+          full.push_back(i);
+          continue;
+        }
+        // The first command is always admitted, so the build progresses
+        bool admitted = !_admission || running == 0 ||
+                        _admit(memory[i], claimed, running);
+        std::optional<char> token = {};
+        if (admitted && _jobserver && !implicitSlot) {
+          token = _jobserver->tryAcquire();
+          starved = !token;
+        }
+        if (!admitted || starved) {
+          held = !admitted;
+          ready.push_back(i);
+          std::push_heap(ready.begin(), ready.end(), later);
+          break;
+        }
+        if (poolOf[i] >= 0) {
+          pools[poolOf[i]].second++;
+        }
+        tokens[i] = token;
+        if (!token) {
+          implicitSlot = false;
+        }
+        _Command &c = _commands[i];
+        if (c.restat) {
+          _recordOutputs(i);
+        }
+        COBBLER_LOG("Executing %s command: %s",
+                    c.calltype == io::async ? "asynchronous" : "synchronous",
+                    c.call.front().c_str());
+        running++;
+        claimed += memory[i];
+        timings[i].start = std::chrono::steady_clock::now();
+        auto lane = std::find(lanes.begin(), lanes.end(), false);
+        timings[i].lane = lane - lanes.begin();
+        if (lane == lanes.end()) {
+          lanes.push_back(true);
+        } else {
+          *lane = true;
+        }
+        _launch(i);
+      }
+      for (size_t i : full) {
+        ready.push_back(i);
+        std::push_heap(ready.begin(), ready.end(), later);
+      }
+
+      if (running == 0 && (_cancelled || stopping)) {
+        break;
+      }
+      if (running == 0 && finished == _commands.size()) {
+        // The last commands were up to date
+        continue;
+      }
+      if (running == 0) {
+        COBBLER_ERROR("Dependency cycle between %zu command(s), aborting",
+                      _commands.size() - finished);
+        exit(EXIT_FAILURE);
+      }
+
+      std::vector<_Done> done = {};
+      {
+        std::unique_lock lock(_doneMutex);
+        auto isDone = [this]() { return !_done.empty(); };
+        if (starved) {
+          // Tokens are returned by other processes without notice
+          _doneSignal.wait_for(lock, std::chrono::milliseconds(10), isDone);
+        } else if (held) {
+          // Admission is checked again as the machine's load changes
+          _doneSignal.wait_for(lock, std::chrono::milliseconds(250), isDone);
+        } else {
+          _doneSignal.wait(lock, isDone);
+        }
+        done.swap(_done);
+      }
+      for (auto &[i, result, end] : done) {
+        running--;
+        finished++;
+        claimed -= memory[i];
+        if (poolOf[i] >= 0) {
+          pools[poolOf[i]].second--;
+        }
+        if (tokens[i]) {
+          _jobserver->release(*tokens[i]);
+        } else {
+          implicitSlot = true;
+        }
+        timings[i].end = end;
+        lanes[timings[i].lane] = false;
+        settled[i] = true;
+        for (const auto &output : _commands[i].edges.outputs) {
+          backend::statCache.invalidate(output);
+        }
+        if (_tracePath) {
+          _traceEvent(i, timings[i], result);
+        }
+        if (result.exitCode != 0 && (stopping || _cancelled)) {
+          // Terminated by the run itself
+          failed[i] = true;
+          run.stopped++;
+          continue;
+        }
+        if (_commands[i].awaiting) {
+          // The awaiting task decides what a failure means
+          if (result.exitCode != 0) {
+            run.handled++;
+          } else {
+            run.succeeded++;
+            if (_historyPath) {
+              _recordRun(i, timings[i].end - timings[i].start, result.maxRss);
+            }
+          }
+          *_commands[i].result = std::move(result);
+          resumable.push_back(_commands[i].awaiting);
+          release(i, true);
+          continue;
+        }
+        if (result.exitCode != 0) {
+          COBBLER_ERROR("Command %s encountered an error",
+                        _commands[i].call.front().c_str());
+        }
+        backend::logger.write(result.exitCode == 0
+                                  ? backend::Logger::Level::info
+                                  : backend::Logger::Level::error,
+                              result.output);
+        if (result.exitCode != 0) {
+          failed[i] = true;
+          _failures.push_back({_commands[i].call, std::move(result)});
+          skip(_skipDependents(i, dependents, skipped));
+          if (_stopAfter > 0 && _failures.size() >= _stopAfter) {
+            COBBLER_ERROR("Stopping after %zu failed command(s)",
+                          _failures.size());
+            stopping = true;
+            _terminateRunning();
+          }
+          continue;
+        }
+        run.succeeded++;
+        if (_historyPath) {
+          _recordRun(i, timings[i].end - timings[i].start, result.maxRss);
+        }
+        bool unchanged = _commands[i].restat && _restatOutputs(i);
+        if (_commands[i].onSuccess) {
+          _commands[i].onSuccess();
+        }
+        release(i, !unchanged);
+      }
+      advance();
+    }
+    // Tasks still waiting on commands of a stopped run are dropped, the
+    // commands they added stay like any other
+    for (auto task : _tasks) {
+      task.destroy();
+    }
+    _tasks.clear();
+    for (_Command &c : _commands) {
+      c.awaiting = {};
+      c.result = nullptr;
+    }
+    if (makeflags) {
+      setenv("MAKEFLAGS", makeflags->c_str(), 1);
+    } else if (_jobserver && _jobserver->slots() > 0) {
+      unsetenv("MAKEFLAGS");
+    }
+    // Commands may have written files they did not declare
+    backend::statCache.clear();
+    run.skipped = std::count(skipped.begin(), skipped.end(), true);
+    run.stopped += _commands.size() - finished;
+    // Later calls to cancel() find no run, so they cannot leak into the next
+    bool cancelled = false;
+    {
+      std::scoped_lock lock(_doneMutex);
+      _active = false;
+      cancelled = _cancelled.exchange(false);
+    }
+    if (cancelled) {
+      COBBLER_WARN("Run cancelled, %zu command(s) not started",
+                   _commands.size() - finished);
+    } else {
+      _summarizeFailures(run);
+    }
+    if (_tracePath) {
+      _writeTrace();
+    }
+    if (_historyPath) {
+      _writeHistory();
+    }
+    if (_restatChanged) {
+      _writeRestat();
+    }
+    if (taskException) {
+      std::rethrow_exception(taskException);
+    }
+    run.failures = _failures;
+    return run;
+  }
+
+  /*
+    Stops a run once count commands failed: no further commands are started
+    and the ones still running are terminated along with their process
+    groups. 1 fails fast, 0 (the default) keeps going. Either way commands
+    depending on a failed one are skipped.
+  */
+  inline Cobbler &stopAfter(size_t count) {
+    _stopAfter = count;
+    return (*this);
+  }
+
+  /*
+    Stops the current run from starting further commands and terminates the
+    spawned ones still running, operator() returns once they were reaped.
+    Does nothing outside of a run. Safe to call from any thread.
+  */
+  inline void cancel() {
+    {
+      std::scoped_lock lock(_doneMutex);
+      if (!_active) {
+        return;
+      }
+      _cancelled = true;
+    }
+    _terminateRunning();
+  }
+
+  // Number of runs started so far, see awaitRun()
+  inline size_t runs() {
+    std::scoped_lock lock(_doneMutex);
+    return _runs;
+  }
+
+  /*
+    Blocks until more than count runs were started, e.g. until a run begun
+    on another thread is active and can be cancelled:
+      size_t count = c.runs();
+      std::thread runner([&c]() { c(); });
+      c.awaitRun(count);
+  */
+  inline void awaitRun(size_t count) {
+    std::unique_lock lock(_doneMutex);
+    _startSignal.wait(lock, [this, count]() { return _runs > count; });
+  }
+
+  /*
+    Starts task with the next run, or right away when called from a task
+    of the current one. Its commands are scheduled next to the others, e.g.
+      c.spawn([](Cobbler &c) -> Cobbler::Task {
+        auto probe = co_await c.run("pkg-config", "--cflags", "zlib");
+        if (probe.exitCode == 0) { ... }
+      }(c));
+    Tasks still suspended when a run ends are destroyed.
+  */
+  inline Cobbler &spawn(Task task) {
+    _newTasks.push_back(std::exchange(task._handle, {}));
+    return (*this);
+  }
+
+  /*
+    Awaited from a Task: adds command to the running graph and resumes the
+    task with its Result once it exited, its output captured. Awaited
+    commands exiting non-zero do not count as failures but as Run::handled,
+    the task decides what to make of the exit code. Resumes with exit code
+    -1 if an edge failed instead.
+  */
+  inline auto run(const Edges &edges, std::vector<std::string> command) {
+    struct Awaiter {
+      Cobbler &cobbler;
+      std::vector<std::string> command;
+      Edges edges;
+      backend::Result result = {};
+
+      inline bool await_ready() noexcept { return false; }
+      inline void await_suspend(std::coroutine_handle<> task) {
+        Handle h = cobbler._add(io::async, command, edges);
+        cobbler._commands[h.index].awaiting = task;
+        cobbler._commands[h.index].result = &result;
+      }
+      inline backend::Result await_resume() { return std::move(result); }
+    };
+    return Awaiter{*this, std::move(command), edges};
+  }
+
+  template <std::convertible_to<std::string>... S>
+  inline auto run(const Edges &edges, S const &...command) {
+    return run(edges, backend::splatVariadicToArgVector(command...));
+  }
+
+  template <std::convertible_to<std::string>... S>
+  inline auto run(S const &...command) {
+    return run(Edges(), backend::splatVariadicToArgVector(command...));
+  }
+
+  inline auto run(std::vector<std::string> command) {
+    return run(Edges(), std::move(command));
+  }
+
+  // Upper bound on concurrently running commands, defaults to the hardware
+  // concurrency
+  inline Cobbler &jobs(unsigned count) {
+    _jobs = count == 0 ? 1 : count;
+    return (*this);
+  }
+  inline unsigned jobs() const { return _jobs; }
+
+  /*
+    Shares job slots with the rest of the process tree through the GNU make
+    jobserver, enabled by default. Slots are taken from the jobserver of a
+    parent make when MAKEFLAGS announces one, otherwise jobs() slots are
+    served to the commands of each run, so sub-builds like make or other
+    cobbler scripts do not oversubscribe the machine.
+  */
+  inline Cobbler &jobserver(bool enabled) {
+    _useJobserver = enabled;
+    if (!enabled) {
+      _jobserver.reset();
+    }
+    return (*this);
+  }
+
+  /*
+    Collects stdout and stderr of each spawned command instead of letting
+    it inherit the terminal, and prints it as one block once the command
+    finished, so output of parallel commands does not interleave.
+  */
+  inline Cobbler &captureOutput(bool enabled) {
+    _capture = enabled;
+    return (*this);
+  }
+
+  inline const std::vector<Failure> &failures() const { return _failures; }
+
+  // Runs a spawned command with its edges, returns once it finished
+  using Executor = std::function<backend::Result(
+      const std::vector<std::string> &, const Edges &)>;
+  /*
+    Runs spawned commands through fn instead of backend::callAsync, e.g. on
+    remote workers through util::executeRemotely. fn is called from a
+    thread per running command, builtins keep running in-process. cancel()
+    does not reach commands started this way, the run waits for them.
+  */
+  inline Cobbler &executor(Executor fn) {
+    _executor = std::move(fn);
+    return (*this);
+  }
+
+  /*
+    Records start and end of every command along with its CPU time and peak
+    memory, and writes them as Chrome trace events to path after each run,
+    for chrome://tracing or ui.perfetto.dev. Commands running concurrently
+    are placed on separate rows, work done in-process (builtins, cache
+    hits) is categorized as such and reports no usage.
+  */
+  inline Cobbler &trace(const std::filesystem::path &path) {
+    _tracePath = path;
+    return (*this);
+  }
+
+  /*
+    Persists the duration and peak memory of every successful command in
+    path, keyed by its command line. Ready commands are started by their
+    longest remaining path to a final command, which is estimated from
+    these durations; without them every command counts the same. The peak
+    memory is used as estimate by admission().
+  */
+  inline Cobbler &history(const std::filesystem::path &path) {
+    _historyPath = path;
+    _history.clear();
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+      std::istringstream fields(line);
+      std::string key;
+      _HistoryEntry entry = {};
+      if (fields >> key >> entry.seconds) {
+        fields >> entry.maxRss;
+        _history[key] = entry;
+      }
+    }
+    return (*this);
+  }
+
+  /*
+    Holds back commands while the machine is short on memory or busy with
+    other work, see Admission. Replaces tuning jobs() per machine, which can
+    then be left at its default.
+  */
+  inline Cobbler &admission(Admission policy) {
+    _admission = policy;
+    return (*this);
+  }
+  inline Cobbler &admission(bool enabled) {
+    if (enabled) {
+      _admission = Admission{};
+    } else {
+      _admission.reset();
+    }
+    return (*this);
+  }
+
+  inline void clear() {
+    std::scoped_lock lock(_producersMutex);
+    _commands.clear();
+    _producers.clear();
+    _generated.clear();
+  }
+
+  // Command declaring path as one of its outputs, if any
+  inline std::optional<Handle>
+  producer(const std::filesystem::path &path) const {
+    std::scoped_lock lock(_producersMutex);
+    // Resolving the key is costly, and up-to-date checks ask for every input
+    if (_producers.empty()) {
+      return {};
+    }
+    auto it = _producers.find(_edgeKey(path));
+    if (it == _producers.end()) {
+      return {};
+    }
+    return Handle{it->second};
+  }
+
+  /*
+    Declares path as written by the build outside of any command, e.g. a
+    source generated while describing it, until clear() is called.
+  */
+  inline Cobbler &generated(const std::filesystem::path &path) {
+    std::scoped_lock lock(_producersMutex);
+    _generated.insert(_edgeKey(path));
+    return (*this);
+  }
+
+  /*
+    Whether the build itself writes path: an output of a command, a file
+    declared through generated() or one written by trace(), history() and
+    restat(). Safe to call from any thread, util::watch ignores these.
+  */
+  inline bool writes(const std::filesystem::path &path) const {
+    if (producer(path)) {
+      return true;
+    }
+    std::string key = _edgeKey(path);
+    if ((_tracePath && _edgeKey(*_tracePath) == key) ||
+        (_historyPath && _edgeKey(*_historyPath) == key) ||
+        _edgeKey(_restatPath) == key) {
+      return true;
+    }
+    std::scoped_lock lock(_producersMutex);
+    return _generated.contains(key);
+  }
+
+  /*
+    Declares a pool of which at most depth commands run at once, within the
+    overall jobs() limit. Commands are put into a pool with usePool, e.g.
+    to run links two at a time while compiles use every core.
+  */
+  inline Cobbler &pool(const std::string &name, unsigned depth) {
+    _pools[name] = depth == 0 ? 1 : depth;
+    return (*this);
+  }
+
+  inline Cobbler &usePool(Handle h, const std::string &name) {
+    assert(h.index < _commands.size());
+    _commands[h.index].pool = name;
+    return (*this);
+  }
+
+  /*
+    Puts the command into the console pool of depth 1, like ninja's. It
+    runs locally in the foreground process group with the terminal
+    inherited, so it can be interactive and gets the signals of a Ctrl-C
+    itself, while other commands keep running next to it.
+  */
+  inline Cobbler &console(Handle h) {
+    assert(h.index < _commands.size());
+    _pools.try_emplace("console", 1);
+    _commands[h.index].console = true;
+    return usePool(h, "console");
+  }
+
+  /*
+    Compares the declared outputs of h by content once it succeeded. An
+    output that came out identical gets its previous modification time
+    back, and if all of them did, the commands waiting for h are not
+    rebuilt for its sake: they start only if another command they waited
+    for changed its outputs or their upToDate() check fails. Meant for code
+    generators, which often rewrite identical files.
+  */
+  inline Cobbler &restat(Handle h) {
+    assert(h.index < _commands.size());
+    _commands[h.index].restat = true;
+    return (*this);
+  }
+
+  // Where restat() keeps hashes of outputs, .cobbler/restat by default
+  inline Cobbler &restatRecord(const std::filesystem::path &path) {
+    _restatPath = path;
+    _restatLoaded = false;
+    return (*this);
+  }
+
+  /*
+    Checked right before h would start when nothing it waited for changed
+    its outputs during the run, h is not started if check returns true.
+  */
+  inline Cobbler &upToDate(Handle h, std::function<bool(void)> check) {
+    assert(h.index < _commands.size());
+    _commands[h.index].upToDate = std::move(check);
+    return (*this);
+  }
+
+  /*
+    Runs before, if given, on a thread of its own right ahead of spawning h.
+    If it returns a Result, h finishes with it without being spawned, e.g.
+    with its outputs restored from a cache. Otherwise h is spawned as usual
+    and after, if given, gets its Result on that thread once it exited.
+  */
+  inline Cobbler &
+  intercept(Handle h,
+            std::function<std::optional<backend::Result>(void)> before,
+            std::function<void(const backend::Result &)> after = {}) {
+    assert(h.index < _commands.size());
+    _commands[h.index].before = std::move(before);
+    _commands[h.index].after = std::move(after);
+    return (*this);
+  }
+
+  // Runs fn on the scheduling thread once the command succeeded, before any
+  // of its dependents are started
+  inline Cobbler &onSuccess(Handle h, std::function<void(void)> fn) {
+    assert(h.index < _commands.size());
+    _commands[h.index].onSuccess = std::move(fn);
+    return (*this);
+  }
+
+  // Handle of the most recently added command
+  inline Handle last() const {
+    assert(!_commands.empty());
+    return {_commands.size() - 1};
+  }
+
+  template <io TYPE = io::sync, std::convertible_to<std::string>... S>
+  inline Cobbler &cmd(S const &...command) {
+    _add(TYPE, backend::splatVariadicToArgVector(command...), {});
+    return (*this);
+  }
+
+  template <io TYPE = io::sync>
+  inline Cobbler &cmd(const std::vector<std::string> &command) {
+    _add(TYPE, command, {});
+    return (*this);
+  }
+
+  template <io TYPE = io::async, std::convertible_to<std::string>... S>
+  inline Handle job(const Edges &edges, S const &...command) {
+    return _add(TYPE, backend::splatVariadicToArgVector(command...), edges);
+  }
+
+  template <io TYPE = io::async>
+  inline Handle job(const Edges &edges,
+                    const std::vector<std::string> &command) {
+    return _add(TYPE, command, edges);
+  }
+
+  /*
+    Runs fn in-process instead of spawning a child, fn returns an exit code.
+    description is only used for logging, its first element naming the
+    command.
+  */
+  template <io TYPE = io::async>
+  inline Handle job(const Edges &edges,
+                    const std::vector<std::string> &description,
+                    std::function<int(void)> fn) {
+    return _add(TYPE, description, edges, std::move(fn));
+  }
+
+  /*
+    Builtins, run in-process through the scheduler like the job above
+    instead of forking the equivalent coreutils. Paths they create are
+    declared as outputs, the source of copy as an input, on top of edges.
+  */
+  template <io TYPE = io::async>
+  inline Handle remove(const std::filesystem::path &path,
+                       Edges edges = {}) {
+    return _builtin<TYPE>({"rm", path.string()}, std::move(edges), [path]() {
+      return backend::removePath(path);
+    });
+  }
+
+  template <io TYPE = io::async>
+  inline Handle mkdir(const std::filesystem::path &path, Edges edges = {}) {
+    edges.outputs.push_back(path);
+    return _builtin<TYPE>({"mkdir", path.string()}, std::move(edges),
+                          [path]() { return backend::makeDirectory(path); });
+  }
+
+  template <io TYPE = io::async>
+  inline Handle copy(const std::filesystem::path &from,
+                     const std::filesystem::path &to, Edges edges = {}) {
+    edges.inputs.push_back(from);
+    edges.outputs.push_back(to);
+    return _builtin<TYPE>(
+        {"cp", from.string(), to.string()}, std::move(edges),
+        [from, to]() { return backend::copyPath(from, to); });
+  }
+
+  template <io TYPE = io::async>
+  inline Handle symlink(const std::filesystem::path &target,
+                        const std::filesystem::path &link, Edges edges = {}) {
+    edges.outputs.push_back(link);
+    return _builtin<TYPE>(
+        {"ln", target.string(), link.string()}, std::move(edges),
+        [target, link]() { return backend::makeSymlink(target, link); });
+  }
+
+  template <io TYPE = io::async>
+  inline Handle writeFile(const std::filesystem::path &path,
+                          std::string content, Edges edges = {}) {
+    edges.outputs.push_back(path);
+    return _builtin<TYPE>({"write", path.string()}, std::move(edges),
+                          [path, content = std::move(content)]() {
+                            return backend::writeFile(path, content);
+                          });
+  }
+
+private:
+  // Wraps an operation returning an errno value into a builtin job
+  template <io TYPE>
+  inline Handle _builtin(std::vector<std::string> description, Edges edges,
+                         std::function<int(void)> op) {
+    auto call = description;
+    return job<TYPE>(edges, description, [call, op]() {
+      int error = op();
+      if (error != 0) {
+        std::string args = {};
+        for (size_t i = 1; i < call.size(); i++) {
+          args += " " + call[i];
+        }
+        COBBLER_ERROR("%s%s: %s", call.front().c_str(), args.c_str(),
+                      strerror(error));
+        return EXIT_FAILURE;
+      }
+      return EXIT_SUCCESS;
+    });
+  }
+
+  struct _Command {
+    io calltype;
+    std::vector<std::string> call;
+    Edges edges;
+    std::function<int(void)> builtin;
+    std::function<void(void)> onSuccess = {};
+    std::string pool = {};
+    bool console = false;
+    bool restat = false;
+    std::function<bool(void)> upToDate = {};
+    std::function<std::optional<backend::Result>(void)> before = {};
+    std::function<void(const backend::Result &)> after = {};
+    // Set for commands awaited by a Task, which receives their result
+    std::coroutine_handle<> awaiting = {};
+    backend::Result *result = nullptr;
+  };
+  struct _Done {
+    size_t index;
+    backend::Result result;
+    std::chrono::steady_clock::time_point end;
+  };
+  struct _Timing {
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+    size_t lane;
+  };
+
+  inline Handle _add(io calltype, const std::vector<std::string> &call,
+                     const Edges &edges,
+                     std::function<int(void)> builtin = {}) {
+    for (const Handle &h : edges.after) {
+      assert(h.index < _commands.size());
+    }
+    _commands.push_back({.calltype = calltype,
+                         .call = call,
+                         .edges = edges,
+                         .builtin = std::move(builtin)});
+    // Written under the lock only, producer() is read from other threads
+    std::scoped_lock lock(_producersMutex);
+    for (const auto &output : edges.outputs) {
+      _producers[_edgeKey(output)] = _commands.size() - 1;
+    }
+    return {_commands.size() - 1};
+  }
+
+  inline void _launch(size_t i) {
+    auto onExit = [this, i](const backend::Result &result) {
+      auto end = std::chrono::steady_clock::now();
+      std::scoped_lock lock(_doneMutex);
+      _running.erase(i);
+      _done.push_back({i, result, end});
+      _doneSignal.notify_one();
+    };
+    const _Command &c = _commands[i];
+    // Own process groups are signalled as a whole, console commands alone
+    auto onStart = [this, i, console = c.console](pid_t pid) {
+      std::scoped_lock lock(_doneMutex);
+      _running[i] = console ? pid : -pid;
+      if (_cancelled) {
+        kill(_running[i], SIGTERM);
+      }
+    };
+    bool capture = !c.console && (_capture || c.awaiting);
+    if (c.builtin) {
+      // Copied, tasks may add commands while it runs
+      std::thread t([builtin = c.builtin, onExit]() {
+        onExit({.exitCode = builtin()});
+      });
+      t.detach();
+      return;
+    }
+    if (c.before || c.after) {
+      std::thread t([before = c.before, after = c.after, call = c.call,
+                     edges = c.edges, console = c.console,
+                     executor = c.console ? Executor{} : _executor, capture,
+                     onStart, onExit]() {
+        if (auto result = before ? before() : std::nullopt) {
+          onExit(result.value());
+          return;
+        }
+        backend::Result result = {};
+        if (executor) {
+          result = executor(call, edges);
+        } else {
+          backend::callAsync(
+              call, [&result](const backend::Result &r) { result = r; },
+              capture, onStart, console)
+              .wait();
+        }
+        if (after) {
+          after(result);
+        }
+        onExit(result);
+      });
+      t.detach();
+      return;
+    }
+    if (_executor && !c.console) {
+      std::thread t([executor = _executor, call = c.call, edges = c.edges,
+                     onExit]() { onExit(executor(call, edges)); });
+      t.detach();
+      return;
+    }
+    backend::callAsync(c.call, onExit, capture, onStart, c.console);
+  }
+
+  inline void _terminateRunning() {
+    std::scoped_lock lock(_doneMutex);
+    for (const auto &[i, target] : _running) {
+      kill(target, SIGTERM);
+    }
+  }
+
+  // Marks every command depending on i as skipped, returns them
+  inline std::vector<size_t>
+  _skipDependents(size_t i, const std::vector<std::vector<size_t>> &deps,
+                  std::vector<bool> &skipped) const {
+    std::vector<size_t> newlySkipped = {};
+    std::vector<size_t> stack = deps[i];
+    while (!stack.empty()) {
+      size_t d = stack.back();
+      stack.pop_back();
+      if (skipped[d]) {
+        continue;
+      }
+      skipped[d] = true;
+      newlySkipped.push_back(d);
+      stack.insert(stack.end(), deps[d].begin(), deps[d].end());
+    }
+    return newlySkipped;
+  }
+
+  inline void _summarizeFailures(const Run &run) const {
+    if (run.skipped > 0) {
+      COBBLER_WARN("%zu command(s) skipped after a failure", run.skipped);
+    }
+    if (_failures.empty()) {
+      return;
+    }
+    COBBLER_ERROR("%zu command(s) failed:", _failures.size());
+    COBBLER_PUSH_INDENT();
+    for (const Failure &f : _failures) {
+      std::string call = {};
+      for (const auto &arg : f.call) {
+        call += (call.empty() ? "" : " ") + arg;
+      }
+      COBBLER_ERROR("%s (exit code %d)", call.c_str(), f.result.exitCode);
+      backend::logger.write(backend::Logger::Level::error, f.result.output);
+    }
+    COBBLER_POP_INDENT();
+  }
+
+  inline void _traceEvent(size_t i, const _Timing &timing,
+                          const backend::Result &result) {
+    using us = std::chrono::microseconds;
+    const _Command &c = _commands[i];
+    std::string call = {};
+    for (const auto &arg : c.call) {
+      call += (call.empty() ? "" : " ") + arg;
+    }
+    // Work done in-process has no usage of its own to report
+    char usage[128] = "";
+    if (result.measured) {
+      snprintf(usage, sizeof(usage),
+               "\"userTime\": %.3f, \"systemTime\": %.3f, "
+               "\"maxRssKiB\": %ld, ",
+               result.userTime, result.systemTime, result.maxRss);
+    }
+    // Only numbers are formatted, names and commands have no length bound
+    char numbers[192];
+    snprintf(numbers, sizeof(numbers),
+             "\"ph\": \"X\", \"ts\": %lld, \"dur\": %lld, \"pid\": %d, "
+             "\"tid\": %zu, \"args\": {\"exitCode\": %d, ",
+             (long long)std::chrono::duration_cast<us>(timing.start -
+                                                       _traceEpoch)
+                 .count(),
+             (long long)std::chrono::duration_cast<us>(timing.end -
+                                                       timing.start)
+                 .count(),
+             int(getpid()), timing.lane, result.exitCode);
+    std::string category = c.builtin         ? "builtin"
+                           : result.measured ? "command"
+                                             : "in-process";
+    _traceEvents.push_back("{\"name\": \"" +
+                           backend::jsonEscape(c.call.front()) +
+                           "\", \"cat\": \"" + category + "\", " + numbers +
+                           usage + "\"command\": \"" +
+                           backend::jsonEscape(call) + "\"}}");
+  }
+
+  inline void _writeTrace() const {
+    std::ofstream file(_tracePath.value());
+    if (!file) {
+      COBBLER_WARN("Could not write trace to %s",
+                   _tracePath->string().c_str());
+      return;
+    }
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    for (size_t i = 0; i < _traceEvents.size(); i++) {
+      file << "  " << _traceEvents[i]
+           << (i + 1 < _traceEvents.size() ? ",\n" : "\n");
+    }
+    file << "]}\n";
+  }
+
+  /*
+    Joins or starts the jobserver for a run. When serving, MAKEFLAGS is
+    extended for the children and its previous value, if any, returned to
+    be restored after the run.
+  */
+  inline std::optional<std::string> _joinJobserver() {
+    if (!_useJobserver) {
+      return {};
+    }
+    if (!_jobserver) {
+      _jobserver = backend::Jobserver::fromEnvironment();
+    }
+    if (_jobserver && _jobserver->slots() == 0) {
+      return {};
+    }
+    if (!_jobserver || _jobserver->slots() != _jobs) {
+      _jobserver.reset();
+      if (_jobs > 1) {
+        _jobserver = backend::Jobserver::serve(_jobs);
+      }
+    }
+    if (!_jobserver) {
+      return {};
+    }
+    const char *previous = getenv("MAKEFLAGS");
+    std::string flags = previous ? previous : "";
+    flags += " -j" + std::to_string(_jobs) +
+             " --jobserver-auth=" + _jobserver->auth();
+    setenv("MAKEFLAGS", flags.c_str(), 1);
+    if (previous) {
+      return std::string(previous);
+    }
+    return {};
+  }
+
+  // FNV-1a of the command line, stable across runs and builds
+  static inline std::string _historyKey(const std::vector<std::string> &call) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const auto &arg : call) {
+      for (unsigned char ch : arg) {
+        hash = (hash ^ ch) * 0x100000001b3;
+      }
+      hash = (hash ^ 0xff) * 0x100000001b3;
+    }
+    char key[17];
+    snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+    return key;
+  }
+
+  inline void _recordRun(size_t i, std::chrono::steady_clock::duration duration,
+                         long maxRss) {
+    double seconds = std::chrono::duration<double>(duration).count();
+    auto [it, inserted] = _history.try_emplace(_historyKey(_commands[i].call),
+                                               _HistoryEntry{seconds, maxRss});
+    if (!inserted) {
+      // Smooths out noise of single runs, the peak is kept conservative
+      it->second.seconds = 0.5 * it->second.seconds + 0.5 * seconds;
+      it->second.maxRss = std::max(maxRss, (it->second.maxRss + maxRss) / 2);
+    }
+  }
+
+  // Expected peak memory of command i in bytes, 0 if unknown
+  inline uint64_t _memoryEstimate(size_t i) const {
+    if (!_admission) {
+      return 0;
+    }
+    auto it = _history.find(_historyKey(_commands[i].call));
+    return it != _history.end() ? uint64_t(it->second.maxRss) * 1024 : 0;
+  }
+  inline std::vector<uint64_t> _memoryEstimates() const {
+    std::vector<uint64_t> memory(_commands.size(), 0);
+    for (size_t i = 0; i < _commands.size(); i++) {
+      memory[i] = _memoryEstimate(i);
+    }
+    return memory;
+  }
+
+  // Average known duration in seconds, 1 without history
+  inline double _averageDuration() const {
+    if (_history.empty()) {
+      return 1.0;
+    }
+    double total = 0;
+    for (const auto &[key, entry] : _history) {
+      total += entry.seconds;
+    }
+    return total / _history.size();
+  }
+  inline double _durationEstimate(size_t i, double fallback) const {
+    auto it = _history.find(_historyKey(_commands[i].call));
+    return it != _history.end() ? it->second.seconds : fallback;
+  }
+
+  /*
+    Whether a command expected to peak at memory bytes may start next to
+    running ones. Their claimed estimates are counted in full, as they may
+    not have reached their peak yet.
+  */
+  inline bool _admit(uint64_t memory, uint64_t claimed, size_t running) {
+    std::string reason = {};
+    auto available = backend::memoryAvailable();
+    auto pressure = backend::memoryPressure();
+    auto load = backend::loadAverage();
+    double maxLoad = _admission->maxLoad > 0
+                         ? _admission->maxLoad
+                         : double(backend::defaultJobCount());
+    if (available &&
+        *available < _admission->reserve + memory + claimed) {
+      reason = "low on memory";
+    } else if (pressure && *pressure > _admission->maxMemoryPressure) {
+      reason = "memory pressure";
+    } else if (load && *load - double(running) > maxLoad) {
+      reason = "load from other processes";
+    }
+    if (!reason.empty() && reason != _holdReason) {
+      COBBLER_WARN("Holding back commands: %s", reason.c_str());
+    }
+    _holdReason = reason;
+    return reason.empty();
+  }
+
+  inline void _writeHistory() const {
+    std::filesystem::path tmp = _historyPath->string() + ".tmp";
+    {
+      std::ofstream file(tmp);
+      for (const auto &[key, entry] : _history) {
+        file << key << " " << entry.seconds << " " << entry.maxRss << "\n";
+      }
+      if (!file) {
+        COBBLER_WARN("Could not write history to %s",
+                     _historyPath->string().c_str());
+        return;
+      }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, _historyPath.value(), ec);
+  }
+
+  inline void _loadRestat() {
+    if (_restatLoaded) {
+      return;
+    }
+    _restatLoaded = true;
+    _outputHashes.clear();
+    std::ifstream file(_restatPath);
+    std::string line;
+    while (std::getline(file, line)) {
+      std::istringstream fields(line);
+      _OutputHash entry = {};
+      std::string path;
+      if (fields >> std::hex >> entry.hash >> std::dec >> entry.mtime &&
+          fields.get() == ' ' && std::getline(fields, path)) {
+        _outputHashes[path] = entry;
+      }
+    }
+  }
+
+  // Hashes outputs of i not known yet, before i overwrites them
+  inline void _recordOutputs(size_t i) {
+    _loadRestat();
+    for (const auto &output : _commands[i].edges.outputs) {
+      std::string key = _edgeKey(output);
+      backend::FileStat st = backend::statCache.get(output);
+      // Rehashed if the output changed since it was recorded
+      auto recorded = _outputHashes.find(key);
+      if (recorded != _outputHashes.end() && st.exists &&
+          st.mtime == recorded->second.mtime) {
+        continue;
+      }
+      auto hash = backend::hashContent(output);
+      if (st.exists && hash) {
+        _outputHashes[key] = {*hash, st.mtime};
+        _restatChanged = true;
+      }
+    }
+  }
+
+  /*
+    True if every output of i has the content recorded before it ran,
+    these get their recorded modification time back.
+  */
+  inline bool _restatOutputs(size_t i) {
+    const auto &outputs = _commands[i].edges.outputs;
+    bool unchanged = !outputs.empty();
+    for (const auto &output : outputs) {
+      std::string key = _edgeKey(output);
+      backend::FileStat st = backend::statCache.get(output);
+      auto hash = backend::hashContent(output);
+      auto it = _outputHashes.find(key);
+      if (hash && it != _outputHashes.end() && it->second.hash == *hash) {
+        timespec times[2] = {};
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_sec = it->second.mtime / 1000000000;
+        times[1].tv_nsec = it->second.mtime % 1000000000;
+        utimensat(AT_FDCWD, output.c_str(), times, 0);
+        backend::statCache.invalidate(output);
+        continue;
+      }
+      unchanged = false;
+      if (hash) {
+        _outputHashes[key] = {*hash, st.mtime};
+      } else {
+        _outputHashes.erase(key);
+      }
+      _restatChanged = true;
+    }
+    return unchanged;
+  }
+
+  inline void _writeRestat() {
+    _restatChanged = false;
+    std::error_code ec;
+    if (_restatPath.has_parent_path()) {
+      std::filesystem::create_directories(_restatPath.parent_path(), ec);
+    }
+    std::filesystem::path tmp = _restatPath.string() + ".tmp";
+    {
+      std::ofstream file(tmp);
+      for (const auto &[path, entry] : _outputHashes) {
+        file << std::hex << entry.hash << std::dec << " " << entry.mtime
+             << " " << path << "\n";
+      }
+      if (!file) {
+        COBBLER_WARN("Could not write output hashes to %s",
+                     _restatPath.string().c_str());
+        return;
+      }
+    }
+    std::filesystem::rename(tmp, _restatPath, ec);
+  }
+
+  /*
+    Estimated time from the start of each command until every command
+    depending on it finished, commands without a known duration count as
+    the average known one.
+  */
+  inline std::vector<double>
+  _criticalPaths(const std::vector<std::vector<size_t>> &dependents,
+                 std::vector<size_t> pending) const {
+    double average = _averageDuration();
+    std::vector<double> estimate(_commands.size());
+    for (size_t i = 0; i < _commands.size(); i++) {
+      estimate[i] = _durationEstimate(i, average);
+    }
+
+    // Topological order, commands caught in a cycle are left out
+    std::vector<size_t> order = {};
+    for (size_t i = 0; i < _commands.size(); i++) {
+      if (pending[i] == 0) {
+        order.push_back(i);
+      }
+    }
+    for (size_t next = 0; next < order.size(); next++) {
+      for (size_t d : dependents[order[next]]) {
+        if (--pending[d] == 0) {
+          order.push_back(d);
+        }
+      }
+    }
+
+    std::vector<double> path = estimate;
+    for (auto it = order.rbegin(); it != order.rend(); it++) {
+      for (size_t d : dependents[*it]) {
+        path[*it] = std::max(path[*it], estimate[*it] + path[d]);
+      }
+    }
+    return path;
+  }
+
+  static inline std::string _edgeKey(const std::filesystem::path &p) {
+    return std::filesystem::absolute(p).lexically_normal().string();
+  }
+
+  // Commands i has to wait for, lastSync being the last io::sync before it
+  inline std::vector<size_t>
+  _dependencies(size_t i, std::optional<size_t> lastSync) const {
+    const _Command &c = _commands[i];
+    std::vector<size_t> deps = {};
+    for (const Handle &h : c.edges.after) {
+      deps.push_back(h.index);
+    }
+    for (const auto &input : c.edges.inputs) {
+      auto it = _producers.find(_edgeKey(input));
+      if (it != _producers.end() && it->second != i) {
+        deps.push_back(it->second);
+      }
+    }
+    if (lastSync) {
+      deps.push_back(lastSync.value());
+    }
+    std::sort(deps.begin(), deps.end());
+    deps.erase(std::unique(deps.begin(), deps.end()), deps.end());
+    return deps;
+  }
+
+  // Returns the last io::sync command
+  inline std::optional<size_t>
+  _resolveEdges(std::vector<std::vector<size_t>> &dependents,
+                std::vector<size_t> &pending) const {
+    std::optional<size_t> lastSync = {};
+    for (size_t i = 0; i < _commands.size(); i++) {
+      std::vector<size_t> deps = _dependencies(i, lastSync);
+      for (size_t d : deps) {
+        dependents[d].push_back(i);
+      }
+      pending[i] = deps.size();
+      if (_commands[i].calltype == io::sync) {
+        lastSync = i;
+      }
+    }
+    return lastSync;
+  }
+
+  std::vector<_Command> _commands;
+  // Tasks to start with the next run, and the ones started by it
+  std::vector<std::coroutine_handle<Task::promise_type>> _newTasks = {};
+  std::vector<std::coroutine_handle<Task::promise_type>> _tasks = {};
+  std::unordered_map<std::string, size_t> _producers;
+  std::unordered_set<std::string> _generated;
+  mutable std::mutex _producersMutex;
+  unsigned _jobs = backend::defaultJobCount();
+  bool _capture = false;
+  Executor _executor = {};
+  std::vector<Failure> _failures;
+
+  std::optional<std::filesystem::path> _tracePath;
+  std::chrono::steady_clock::time_point _traceEpoch =
+      std::chrono::steady_clock::now();
+  std::vector<std::string> _traceEvents;
+
+  std::optional<std::filesystem::path> _historyPath;
+  struct _HistoryEntry {
+    double seconds;
+    long maxRss = 0;
+  };
+  std::unordered_map<std::string, _HistoryEntry> _history;
+  std::filesystem::path _restatPath = ".cobbler/restat";
+  bool _restatLoaded = false;
+  bool _restatChanged = false;
+  struct _OutputHash {
+    uint64_t hash;
+    int64_t mtime;
+  };
+  // By absolute path of the output
+  std::unordered_map<std::string, _OutputHash> _outputHashes;
+  std::optional<Admission> _admission;
+  bool _useJobserver = true;
+  std::unique_ptr<backend::Jobserver> _jobserver;
+  std::string _holdReason;
+
+  std::mutex _doneMutex;
+  std::condition_variable _doneSignal;
+  std::vector<_Done> _done;
+  // Spawned commands still running with the target to signal, the negated
+  // process group or the pid of console commands, guarded by _doneMutex
+  std::unordered_map<size_t, pid_t> _running;
+  // Guarded by _doneMutex: whether operator() is running, and how many
+  // runs were started
+  bool _active = false;
+  size_t _runs = 0;
+  std::condition_variable _startSignal;
+  std::atomic_bool _cancelled = false;
+  size_t _stopAfter = 0;
+  std::unordered_map<std::string, unsigned> _pools;
 };
 } // namespace cbl
 #endif // !COBBLER_H
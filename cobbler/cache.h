@@ -0,0 +1,250 @@
+#ifndef COBBLER_CACHE_H
+#define COBBLER_CACHE_H
+#include "../cobbler.h"
+#include "hash.h"
+#include <sys/stat.h>
+
+namespace cbl {
+namespace util {
+
+/*
+  Content-addressed object cache in the spirit of ccache. Entries are keyed
+  by the identity of the compiler, the compile command line without its
+  output paths and the preprocessed unit. Once the cache grows past
+  maxSize, the least recently used entries are evicted.
+*/
+struct ObjectCache {
+  inline ObjectCache(std::filesystem::path dir = defaultDirectory(),
+                     uintmax_t maxSize = uintmax_t(5) << 30)
+      : _dir(std::move(dir)), _maxSize(maxSize) {
+    std::filesystem::create_directories(_dir);
+  }
+  inline ObjectCache(const ObjectCache &) = delete;
+
+  // $COBBLER_CACHE_DIR, $XDG_CACHE_HOME/cobbler or ~/.cache/cobbler
+  static inline std::filesystem::path defaultDirectory() {
+    if (const char *dir = getenv("COBBLER_CACHE_DIR")) {
+      return dir;
+    }
+    if (const char *dir = getenv("XDG_CACHE_HOME")) {
+      return std::filesystem::path(dir) / "cobbler";
+    }
+    if (const char *home = getenv("HOME")) {
+      return std::filesystem::path(home) / ".cache" / "cobbler";
+    }
+    return std::filesystem::temp_directory_path() / "cobbler-cache";
+  }
+
+  /*
+    Looks up the object of a "c++ -c unit -o object ..." command. The unit
+    is preprocessed with the same flags to compute its key, on a hit the
+    object is restored from the cache. Returns the key, empty if the unit
+    could not be preprocessed, and whether object was restored.
+  */
+  inline std::pair<std::string, bool>
+  lookup(const std::vector<std::string> &command,
+         const std::filesystem::path &object) {
+    std::filesystem::path preprocessed = object.string() + ".i";
+    std::vector<std::string> preprocess = command;
+    for (size_t i = 0; i < preprocess.size(); i++) {
+      if (preprocess[i] == "-c") {
+        preprocess[i] = "-E";
+      } else if (preprocess[i] == "-o" && i + 1 < preprocess.size()) {
+        preprocess[++i] = preprocessed.string();
+      }
+    }
+
+    std::error_code ec;
+    if (backend::call(preprocess) != 0) {
+      std::filesystem::remove(preprocessed, ec);
+      _misses++;
+      return {"", false};
+    }
+
+    Hasher h;
+    h.update(_compilerIdentity(command.front()));
+    for (size_t i = 0; i < command.size(); i++) {
+      h.update(command[i]);
+      if (command[i] == "-o" || command[i] == "-MF" || command[i] == "-MT") {
+        i++;
+      }
+    }
+    h.updateFile(preprocessed);
+    std::filesystem::remove(preprocessed, ec);
+    std::string key = h.hex();
+
+    if (_restore(_entry(key), object)) {
+      _hits++;
+      COBBLER_LOG("Restored object from cache: %s", object.string().c_str());
+      return {key, true};
+    }
+    _misses++;
+    return {key, false};
+  }
+
+  // Stores object as built by the command lookup() returned key for
+  inline void store(const std::string &key,
+                    const std::filesystem::path &object) {
+    if (!key.empty()) {
+      _store(object, _entry(key));
+    }
+  }
+
+  inline uint64_t hits() const { return _hits; }
+  inline uint64_t misses() const { return _misses; }
+  inline const std::filesystem::path &directory() const { return _dir; }
+
+  inline void printStats() {
+    uint64_t total = _hits + _misses;
+    COBBLER_LOG("Object cache: %llu hit(s), %llu miss(es) (%.1f%% hit rate)",
+                (unsigned long long)_hits.load(),
+                (unsigned long long)_misses.load(),
+                total == 0 ? 0.0 : 100.0 * _hits / total);
+  }
+
+private:
+  inline std::filesystem::path _entry(const std::string &key) const {
+    return _dir / key.substr(0, 2) / (key.substr(2) + ".o");
+  }
+
+  static inline std::string _tempName(const std::filesystem::path &p) {
+    static std::atomic_uint64_t counter = 0;
+    return p.string() + ".tmp." + std::to_string(getpid()) + "." +
+           std::to_string(counter++);
+  }
+
+  inline bool _restore(const std::filesystem::path &entry,
+                       const std::filesystem::path &object) {
+    std::error_code ec;
+    std::filesystem::path tmp = _tempName(object);
+    if (!std::filesystem::copy_file(
+            entry, tmp, std::filesystem::copy_options::overwrite_existing,
+            ec)) {
+      return false;
+    }
+    std::filesystem::rename(tmp, object, ec);
+    if (ec) {
+      std::filesystem::remove(tmp, ec);
+      return false;
+    }
+    // Entries are evicted by their last use
+    std::filesystem::last_write_time(
+        entry, std::filesystem::file_time_type::clock::now(), ec);
+    return true;
+  }
+
+  inline void _store(const std::filesystem::path &object,
+                     const std::filesystem::path &entry) {
+    std::error_code ec;
+    std::filesystem::create_directories(entry.parent_path(), ec);
+    std::filesystem::path tmp = _tempName(entry);
+    if (!std::filesystem::copy_file(object, tmp, ec)) {
+      COBBLER_WARN("Could not store %s in object cache: %s",
+                   object.string().c_str(), ec.message().c_str());
+      return;
+    }
+    std::filesystem::rename(tmp, entry, ec);
+    if (ec) {
+      std::filesystem::remove(tmp, ec);
+      return;
+    }
+
+    std::scoped_lock lock(_mutex);
+    if (!_size) {
+      _size = 0;
+      for (const auto &e : _entries()) {
+        *_size += e.size;
+      }
+    } else {
+      *_size += std::filesystem::file_size(entry, ec);
+    }
+    if (*_size > _maxSize) {
+      _evict();
+    }
+  }
+
+  struct _Entry {
+    std::filesystem::path path;
+    std::filesystem::file_time_type lastUse;
+    uintmax_t size;
+  };
+
+  inline std::vector<_Entry> _entries() const {
+    std::vector<_Entry> entries = {};
+    std::error_code ec;
+    for (const auto &e :
+         std::filesystem::recursive_directory_iterator(_dir, ec)) {
+      if (e.is_regular_file(ec) && e.path().extension() == ".o") {
+        entries.push_back({e.path(), e.last_write_time(ec), e.file_size(ec)});
+      }
+    }
+    return entries;
+  }
+
+  // Removes least recently used entries until 90% of maxSize is reached
+  inline void _evict() {
+    auto entries = _entries();
+    std::sort(entries.begin(), entries.end(),
+              [](const _Entry &a, const _Entry &b) {
+                return a.lastUse < b.lastUse;
+              });
+    uintmax_t size = 0;
+    for (const auto &e : entries) {
+      size += e.size;
+    }
+    uintmax_t goal = _maxSize / 10 * 9;
+    std::error_code ec;
+    size_t evicted = 0;
+    for (const auto &e : entries) {
+      if (size <= goal) {
+        break;
+      }
+      if (std::filesystem::remove(e.path, ec)) {
+        size -= e.size;
+        evicted++;
+      }
+    }
+    _size = size;
+    COBBLER_LOG("Evicted %zu object(s) from cache", evicted);
+  }
+
+  // Resolved compiler path, size and modification time
+  inline std::string _compilerIdentity(const std::string &compiler) {
+    std::scoped_lock lock(_mutex);
+    auto it = _compilers.find(compiler);
+    if (it != _compilers.end()) {
+      return it->second;
+    }
+
+    std::filesystem::path resolved =
+        backend::resolveExecutable(compiler).value_or(compiler);
+
+    std::string identity = compiler;
+    std::error_code ec;
+    auto canonical = std::filesystem::canonical(resolved, ec);
+    struct stat st;
+    if (!ec && stat(canonical.c_str(), &st) == 0) {
+      identity = canonical.string() + ":" + std::to_string(st.st_size) + ":" +
+                 std::to_string(st.st_mtim.tv_sec) + "." +
+                 std::to_string(st.st_mtim.tv_nsec);
+    }
+    _compilers[compiler] = identity;
+    return identity;
+  }
+
+  std::filesystem::path _dir;
+  uintmax_t _maxSize;
+  std::atomic_uint64_t _hits = 0;
+  std::atomic_uint64_t _misses = 0;
+
+  std::mutex _mutex;
+  std::optional<uintmax_t> _size;
+  std::unordered_map<std::string, std::string> _compilers;
+};
+
+// Used by util::compile when set, e.g. objectCache.emplace()
+inline std::optional<ObjectCache> objectCache;
+
+} // namespace util
+} // namespace cbl
+#endif // !COBBLER_CACHE_H
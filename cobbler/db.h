@@ -0,0 +1,332 @@
+#ifndef COBBLER_DB_H
+#define COBBLER_DB_H
+#include "../cobbler.h"
+#include "hash.h"
+#include <cstring>
+#include <sys/mman.h>
+#include <unordered_set>
+
+namespace cbl {
+namespace util {
+
+/*
+  Persistent record of how every output was built, stored as an append-only
+  binary log. For each output it keeps a hash of the command that produced
+  it and the inputs it was built from (the unit and the headers from its
+  depfile), each with its modification time, size and content hash. An
+  output is rebuilt when its command changed or an input's content changed,
+  touching a file without changing it only costs hashing it once.
+
+  Record layout, all integers in native byte order:
+    u32 size of the rest of the record
+    u64 command hash, i64 output mtime in ns, string output
+    u32 input count, per input: i64 mtime in ns, u64 size, u64 hash, string
+  where a string is a u32 length followed by its bytes. An input count of
+  0xffffffff without inputs following marks output as forgotten.
+*/
+struct BuildDb {
+  inline BuildDb(std::filesystem::path file = ".cobbler/build.db")
+      : _file(std::move(file)) {
+    if (_file.has_parent_path()) {
+      std::filesystem::create_directories(_file.parent_path());
+    }
+    _load();
+    _fd = open(_file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (_fd < 0) {
+      COBBLER_WARN("Could not open build database %s: %s", _file.c_str(),
+                   strerror(errno));
+    }
+  }
+  inline BuildDb(const BuildDb &) = delete;
+  ~BuildDb() noexcept {
+    if (_fd >= 0) {
+      close(_fd);
+    }
+  }
+
+  static inline uint64_t hashCommand(const std::vector<std::string> &command) {
+    Hasher h;
+    for (const auto &arg : command) {
+      h.update(arg);
+    }
+    return _truncate(h.hex());
+  }
+
+  /*
+    True if output has to be rebuilt by command: it was never recorded, it
+    is missing or was modified since, command differs from the recorded one
+    or the content of a recorded input changed.
+  */
+  inline bool isDirty(const std::filesystem::path &output,
+                      const std::vector<std::string> &command) {
+    std::scoped_lock lock(_mutex);
+    auto it = _entries.find(_key(output));
+    if (it == _entries.end()) {
+      return true;
+    }
+    _Entry &entry = it->second;
+    backend::FileStat out = _stat(output);
+    if (!out.exists || out.mtime != entry.outputMtime ||
+        entry.command != hashCommand(command)) {
+      return true;
+    }
+    bool touched = false;
+    for (_Input &input : entry.inputs) {
+      backend::FileStat st = _stat(input.path);
+      if (!st.exists) {
+        return true;
+      }
+      if (st.mtime == input.mtime && st.size == input.size) {
+        continue;
+      }
+      // Only dirty if the content changed as well
+      if (st.size != input.size || hashFile(input.path) != input.hash) {
+        return true;
+      }
+      input.mtime = st.mtime;
+      _known[input.path] = input;
+      touched = true;
+    }
+    if (touched) {
+      _append(it->first, entry);
+    }
+    return false;
+  }
+
+  // Records that output was successfully built by command from inputs
+  inline void record(const std::filesystem::path &output,
+                     const std::vector<std::string> &command,
+                     const std::vector<std::filesystem::path> &inputs) {
+    _Entry entry = {.command = hashCommand(command),
+                    .outputMtime = _stat(output).mtime};
+    std::unordered_set<std::string> seen = {};
+    for (const auto &input : inputs) {
+      if (!seen.insert(input.string()).second) {
+        continue;
+      }
+      entry.inputs.push_back(_hashInput(input.string()));
+    }
+    std::string key = _key(output);
+    std::scoped_lock lock(_mutex);
+    _append(key, entry);
+    _entries[key] = std::move(entry);
+  }
+
+  // Drops the record of output, forcing it to be rebuilt
+  inline void forget(const std::filesystem::path &output) {
+    std::string key = _key(output);
+    std::scoped_lock lock(_mutex);
+    if (_entries.erase(key) > 0) {
+      _append(key, {.command = 0, .outputMtime = 0}, true);
+    }
+  }
+
+  static inline uint64_t hashFile(const std::filesystem::path &path) {
+    return _truncate(util::hashFile(path));
+  }
+
+private:
+  struct _Input {
+    std::string path;
+    int64_t mtime;
+    uint64_t size;
+    uint64_t hash;
+  };
+  struct _Entry {
+    uint64_t command;
+    int64_t outputMtime;
+    std::vector<_Input> inputs = {};
+  };
+
+  static inline uint64_t _truncate(const std::string &hex) {
+    return hex.empty() ? 0 : strtoull(hex.substr(0, 16).c_str(), nullptr, 16);
+  }
+
+  static inline std::string _key(const std::filesystem::path &p) {
+    return std::filesystem::absolute(p).lexically_normal().string();
+  }
+
+  static inline backend::FileStat _stat(const std::filesystem::path &p) {
+    return backend::statCache.get(p);
+  }
+
+  // Reuses a known hash of path while its mtime and size are unchanged,
+  // shared inputs like a precompiled header are only hashed once
+  inline _Input _hashInput(const std::string &path) {
+    backend::FileStat st = _stat(path);
+    _Input input = {};
+    input.path = path;
+    input.mtime = st.mtime;
+    input.size = st.size;
+    {
+      std::scoped_lock lock(_mutex);
+      auto it = _known.find(path);
+      if (it != _known.end() && it->second.mtime == st.mtime &&
+          it->second.size == st.size) {
+        return it->second;
+      }
+    }
+    input.hash = st.exists ? hashFile(path) : 0;
+    std::scoped_lock lock(_mutex);
+    _known[path] = input;
+    return input;
+  }
+
+  template <typename T> static inline void _put(std::string &out, T value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+  static inline void _putString(std::string &out, const std::string &s) {
+    _put(out, uint32_t(s.size()));
+    out += s;
+  }
+
+  static constexpr uint32_t _forgotten = 0xffffffff;
+
+  static inline std::string _serialize(const std::string &output,
+                                       const _Entry &entry,
+                                       bool forgotten = false) {
+    std::string body = {};
+    _put(body, entry.command);
+    _put(body, entry.outputMtime);
+    _putString(body, output);
+    _put(body, forgotten ? _forgotten : uint32_t(entry.inputs.size()));
+    for (const _Input &input : entry.inputs) {
+      _put(body, input.mtime);
+      _put(body, input.size);
+      _put(body, input.hash);
+      _putString(body, input.path);
+    }
+    std::string record = {};
+    _put(record, uint32_t(body.size()));
+    return record + body;
+  }
+
+  // Expects _mutex to be held
+  inline void _append(const std::string &output, const _Entry &entry,
+                      bool forgotten = false) {
+    if (_fd < 0) {
+      return;
+    }
+    std::string record = _serialize(output, entry, forgotten);
+    if (write(_fd, record.data(), record.size()) != ssize_t(record.size())) {
+      COBBLER_WARN("Could not append to build database %s", _file.c_str());
+    }
+    _records++;
+  }
+
+  struct _Reader {
+    const char *data;
+    size_t left;
+
+    template <typename T> inline bool get(T &value) {
+      if (left < sizeof(T)) {
+        return false;
+      }
+      memcpy(&value, data, sizeof(T));
+      data += sizeof(T);
+      left -= sizeof(T);
+      return true;
+    }
+    inline bool getString(std::string &s) {
+      uint32_t size;
+      if (!get(size) || left < size) {
+        return false;
+      }
+      s.assign(data, size);
+      data += size;
+      left -= size;
+      return true;
+    }
+  };
+
+  inline void _load() {
+    int fd = open(_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      close(fd);
+      return;
+    }
+    void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+      return;
+    }
+
+    _Reader file = {static_cast<const char *>(mapped), size_t(st.st_size)};
+    size_t valid = 0;
+    uint32_t size;
+    while (file.get(size) && file.left >= size) {
+      _Reader record = {file.data, size};
+      file.data += size;
+      file.left -= size;
+
+      _Entry entry;
+      std::string output;
+      uint32_t count;
+      if (!record.get(entry.command) || !record.get(entry.outputMtime) ||
+          !record.getString(output) || !record.get(count)) {
+        break;
+      }
+      if (count == _forgotten) {
+        _entries.erase(output);
+        _records++;
+        valid = st.st_size - file.left;
+        continue;
+      }
+      bool complete = true;
+      for (uint32_t i = 0; i < count && complete; i++) {
+        _Input input;
+        complete = record.get(input.mtime) && record.get(input.size) &&
+                   record.get(input.hash) && record.getString(input.path);
+        entry.inputs.push_back(std::move(input));
+      }
+      if (!complete) {
+        break;
+      }
+      for (const _Input &input : entry.inputs) {
+        _known[input.path] = input;
+      }
+      _entries[output] = std::move(entry);
+      _records++;
+      valid = st.st_size - file.left;
+    }
+    munmap(mapped, st.st_size);
+
+    // Drops a record torn by a crash, and compacts once mostly superseded
+    if (valid != size_t(st.st_size) ||
+        _records > 2 * _entries.size() + 1024) {
+      _rewrite();
+    }
+  }
+
+  inline void _rewrite() {
+    std::filesystem::path tmp = _file.string() + ".tmp";
+    {
+      std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+      for (const auto &[output, entry] : _entries) {
+        std::string record = _serialize(output, entry);
+        file.write(record.data(), record.size());
+      }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, _file, ec);
+    _records = _entries.size();
+  }
+
+  std::filesystem::path _file;
+  int _fd = -1;
+  size_t _records = 0;
+  std::mutex _mutex;
+  std::unordered_map<std::string, _Entry> _entries;
+  std::unordered_map<std::string, _Input> _known;
+};
+
+// Used by util::compile and util::link when set, e.g. buildDb.emplace()
+inline std::optional<BuildDb> buildDb;
+
+} // namespace util
+} // namespace cbl
+#endif // !COBBLER_DB_H
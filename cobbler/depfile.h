@@ -0,0 +1,99 @@
+#ifndef COBBLER_DEPFILE_H
+#define COBBLER_DEPFILE_H
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace cbl {
+namespace util {
+
+// Depfile written next to an object by util::compile
+inline std::filesystem::path depfileFor(const std::filesystem::path &object) {
+  return std::filesystem::path(object).replace_extension(".d");
+}
+
+/*
+  Reads the prerequisites of the first rule in a make-style depfile as
+  emitted by "-MMD -MF", handling line continuations and escaped spaces.
+  Returns nothing if the depfile does not exist or contains no rule.
+*/
+inline std::optional<std::vector<std::filesystem::path>>
+readDepfile(const std::filesystem::path &depfile) {
+  std::ifstream file(depfile);
+  if (!file) {
+    return {};
+  }
+  std::string content((std::istreambuf_iterator<char>(file)),
+                      std::istreambuf_iterator<char>());
+
+  std::vector<std::string> tokens = {};
+  std::string token = {};
+  bool inRule = false;
+  auto flush = [&]() {
+    if (token.empty()) {
+      return;
+    }
+    if (inRule) {
+      tokens.push_back(token);
+    } else if (token.back() == ':') {
+      inRule = true;
+    }
+    token.clear();
+  };
+
+  for (size_t i = 0; i < content.size(); i++) {
+    char ch = content[i];
+    if (ch == '\\' && i + 1 < content.size()) {
+      char next = content[i + 1];
+      if (next == '\n') {
+        i++;
+        flush();
+        continue;
+      }
+      if (next == '\r' && i + 2 < content.size() && content[i + 2] == '\n') {
+        i += 2;
+        flush();
+        continue;
+      }
+      if (next == ' ' || next == '#' || next == '\\') {
+        token.push_back(next);
+        i++;
+        continue;
+      }
+    }
+    if (ch == '$' && i + 1 < content.size() && content[i + 1] == '$') {
+      token.push_back('$');
+      i++;
+      continue;
+    }
+    if (ch == '\n') {
+      flush();
+      if (inRule) {
+        break;
+      }
+      continue;
+    }
+    if (ch == ' ' || ch == '\t' || ch == '\r') {
+      flush();
+      continue;
+    }
+    token.push_back(ch);
+    // "target: dep" without a space before the colon
+    if (!inRule && ch == ':' && i + 1 < content.size() &&
+        (content[i + 1] == ' ' || content[i + 1] == '\n')) {
+      flush();
+    }
+  }
+  flush();
+
+  if (!inRule) {
+    return {};
+  }
+  return std::vector<std::filesystem::path>(tokens.begin(), tokens.end());
+}
+
+} // namespace util
+} // namespace cbl
+#endif // !COBBLER_DEPFILE_H
@@ -0,0 +1,175 @@
+#ifndef COBBLER_HASH_H
+#define COBBLER_HASH_H
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+namespace cbl {
+namespace util {
+
+// Streaming SHA-256, used to content-address cached build artifacts
+struct Hasher {
+  inline Hasher() { reset(); }
+
+  inline void reset() {
+    _state = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+              0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    _length = 0;
+    _buffered = 0;
+  }
+
+  inline Hasher &update(const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    _length += size;
+    if (_buffered > 0) {
+      size_t take = std::min(size, _buffer.size() - _buffered);
+      memcpy(_buffer.data() + _buffered, bytes, take);
+      _buffered += take;
+      bytes += take;
+      size -= take;
+      if (_buffered < _buffer.size()) {
+        return *this;
+      }
+      _block(_buffer.data());
+      _buffered = 0;
+    }
+    while (size >= _buffer.size()) {
+      _block(bytes);
+      bytes += _buffer.size();
+      size -= _buffer.size();
+    }
+    memcpy(_buffer.data(), bytes, size);
+    _buffered = size;
+    return *this;
+  }
+
+  inline Hasher &update(const std::string &s) {
+    // Length prefixed so that consecutive strings cannot alias
+    uint64_t size = s.size();
+    update(&size, sizeof(size));
+    return update(s.data(), s.size());
+  }
+
+  // Returns false if the file could not be read
+  inline bool updateFile(const std::filesystem::path &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      return false;
+    }
+    std::array<char, 1 << 16> chunk;
+    while (file) {
+      file.read(chunk.data(), chunk.size());
+      update(chunk.data(), file.gcount());
+    }
+    return file.eof();
+  }
+
+  // Lowercase hex digest, the hasher is reset afterwards
+  inline std::string hex() {
+    uint64_t bits = _length * 8;
+    uint8_t pad = 0x80;
+    update(&pad, 1);
+    uint8_t zero = 0;
+    while (_buffered != 56) {
+      update(&zero, 1);
+    }
+    uint8_t lengthBytes[8];
+    for (int i = 0; i < 8; i++) {
+      lengthBytes[i] = uint8_t(bits >> (56 - 8 * i));
+    }
+    update(lengthBytes, 8);
+
+    static constexpr char digits[] = "0123456789abcdef";
+    std::string result;
+    result.reserve(64);
+    for (uint32_t word : _state) {
+      for (int shift = 28; shift >= 0; shift -= 4) {
+        result.push_back(digits[(word >> shift) & 0xf]);
+      }
+    }
+    reset();
+    return result;
+  }
+
+private:
+  static inline uint32_t _rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+  }
+
+  inline void _block(const uint8_t *chunk) {
+    static constexpr uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+        0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+        0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+        0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+      w[i] = (uint32_t(chunk[4 * i]) << 24) |
+             (uint32_t(chunk[4 * i + 1]) << 16) |
+             (uint32_t(chunk[4 * i + 2]) << 8) | uint32_t(chunk[4 * i + 3]);
+    }
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 =
+          _rotr(w[i - 15], 7) ^ _rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 =
+          _rotr(w[i - 2], 17) ^ _rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3],
+             e = _state[4], f = _state[5], g = _state[6], h = _state[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t s1 = _rotr(e, 6) ^ _rotr(e, 11) ^ _rotr(e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + ch + k[i] + w[i];
+      uint32_t s0 = _rotr(a, 2) ^ _rotr(a, 13) ^ _rotr(a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + maj;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    _state[0] += a;
+    _state[1] += b;
+    _state[2] += c;
+    _state[3] += d;
+    _state[4] += e;
+    _state[5] += f;
+    _state[6] += g;
+    _state[7] += h;
+  }
+
+  std::array<uint32_t, 8> _state;
+  std::array<uint8_t, 64> _buffer;
+  uint64_t _length;
+  size_t _buffered;
+};
+
+inline std::string hashFile(const std::filesystem::path &path) {
+  Hasher h;
+  if (!h.updateFile(path)) {
+    return "";
+  }
+  return h.hex();
+}
+
+} // namespace util
+} // namespace cbl
+#endif // !COBBLER_HASH_H
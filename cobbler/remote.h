@@ -0,0 +1,676 @@
+#ifndef COBBLER_REMOTE_H
+#define COBBLER_REMOTE_H
+#include "../cobbler.h"
+#include "depfile.h"
+#include "hash.h"
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <semaphore>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace cbl {
+namespace util {
+
+/*
+  Protocol between a RemoteExecutor and a Worker, one command per
+  connection over a stream socket. Integers are little endian, a string is
+  a u64 length followed by its bytes.
+
+    request  u32 argc, argc strings
+             u32 input count, per input: string path, string hash, u32 mode
+             u32 output count, output count strings
+    missing  u32 count, the hashes of inputs the worker does not store yet
+    blobs    the content of each missing input as a string, in that order
+    result   i32 exit code, string output, f64 user time, f64 system time,
+             i64 max rss, per output: u8 present, u32 mode, string content
+
+  Paths are relative to the working directory of the client. The worker
+  lays the inputs out in a scratch directory, runs the command in there and
+  returns the outputs. It keeps inputs by their SHA-256, so each content
+  only crosses the wire once. A request exceeding the worker's limits on
+  counts and sizes closes the connection.
+
+  There is no authentication: whoever can connect runs arbitrary commands
+  as the worker's user. Workers listen on a Unix socket or on loopback by
+  default and must not be exposed to untrusted networks.
+*/
+namespace remote {
+
+// Blocking I/O on a connected socket, a failure sticks in ok. Counts and
+// string sizes read beyond the limits fail as well.
+struct Channel {
+  int fd;
+  bool ok = true;
+  uint32_t maxCount = UINT32_MAX;
+  uint64_t maxString = UINT64_MAX;
+
+  inline void write(const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (ok && size > 0) {
+      ssize_t n = send(fd, bytes, size, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      ok = n > 0;
+      bytes += std::max<ssize_t>(n, 0);
+      size -= std::max<ssize_t>(n, 0);
+    }
+  }
+  inline void read(void *data, size_t size) {
+    char *bytes = static_cast<char *>(data);
+    while (ok && size > 0) {
+      ssize_t n = recv(fd, bytes, size, 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      ok = n > 0;
+      bytes += std::max<ssize_t>(n, 0);
+      size -= std::max<ssize_t>(n, 0);
+    }
+  }
+
+  template <std::unsigned_integral T> inline void put(T value) {
+    unsigned char bytes[sizeof(T)];
+    for (size_t i = 0; i < sizeof(T); i++) {
+      bytes[i] = uint8_t(value >> (8 * i));
+    }
+    write(bytes, sizeof(T));
+  }
+  template <std::unsigned_integral T> inline T get() {
+    unsigned char bytes[sizeof(T)] = {};
+    read(bytes, sizeof(T));
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+      value |= T(bytes[i]) << (8 * i);
+    }
+    return value;
+  }
+  inline void putDouble(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    put(bits);
+  }
+  inline double getDouble() {
+    uint64_t bits = get<uint64_t>();
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+  inline void putString(const std::string &s) {
+    put(uint64_t(s.size()));
+    write(s.data(), s.size());
+  }
+  // A u32 count of items to read, 0 once it failed
+  inline uint32_t getCount() {
+    uint32_t count = get<uint32_t>();
+    ok = ok && count <= maxCount;
+    return ok ? count : 0;
+  }
+
+  inline std::string getString() {
+    uint64_t size = get<uint64_t>();
+    ok = ok && size <= maxString;
+    std::string s = {};
+    // Grown while reading, a corrupt length only fails the read
+    while (ok && s.size() < size) {
+      size_t chunk = std::min<uint64_t>(size - s.size(), 1 << 20);
+      size_t offset = s.size();
+      s.resize(offset + chunk);
+      read(s.data() + offset, chunk);
+    }
+    return s;
+  }
+  inline void putStrings(const std::vector<std::string> &strings) {
+    put(uint32_t(strings.size()));
+    for (const auto &s : strings) {
+      putString(s);
+    }
+  }
+  inline std::vector<std::string> getStrings() {
+    uint32_t count = getCount();
+    std::vector<std::string> strings = {};
+    for (uint32_t i = 0; i < count && ok; i++) {
+      strings.push_back(getString());
+    }
+    return strings;
+  }
+};
+
+/*
+  Resolves "unix:PATH", or any address containing a '/', to a Unix socket
+  and "HOST:PORT" to TCP. Returns a socket connected to, or with server set
+  listening on, address, -1 with errno set on failure. Servers listen on
+  loopback for an empty HOST, and create Unix sockets accessible to their
+  user only.
+*/
+inline int openSocket(const std::string &address, bool server) {
+  bool local = address.rfind("unix:", 0) == 0 ||
+               address.find('/') != std::string::npos;
+  if (local) {
+    std::string path = address.rfind("unix:", 0) == 0 ? address.substr(5)
+                                                      : address;
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    if (server) {
+      unlink(path.c_str());
+    }
+    const sockaddr *sa = reinterpret_cast<const sockaddr *>(&addr);
+    int status = server ? bind(fd, sa, sizeof(addr))
+                        : connect(fd, sa, sizeof(addr));
+    if (status == 0 && server) {
+      status = chmod(path.c_str(), S_IRUSR | S_IWUSR);
+    }
+    if (status != 0 || (server && listen(fd, SOMAXCONN) != 0)) {
+      int error = errno;
+      close(fd);
+      errno = error;
+      return -1;
+    }
+    return fd;
+  }
+
+  size_t colon = address.rfind(':');
+  if (colon == std::string::npos) {
+    errno = EINVAL;
+    return -1;
+  }
+  std::string host = address.substr(0, colon);
+  std::string port = address.substr(colon + 1);
+  // Without AI_PASSIVE an empty host resolves to loopback
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *found = nullptr;
+  if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(),
+                  &hints, &found) != 0) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  int fd = -1;
+  for (addrinfo *ai = found; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    int one = 1;
+    if (server) {
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    } else {
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (server ? bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+                     listen(fd, SOMAXCONN) == 0
+               : connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(found);
+  return fd;
+}
+
+// Relative, normalized and not escaping the directory it is relative to
+inline bool isContained(const std::filesystem::path &path) {
+  if (path.empty() || path.is_absolute()) {
+    return false;
+  }
+  for (const auto &part : path.lexically_normal()) {
+    if (part == "..") {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace remote
+
+/*
+  Runs commands on a Worker through the protocol above, passed to
+  Cobbler::executor(). The declared inputs of a command are sent along,
+  its declared outputs are written back. Compiles, commands with "-c" or
+  precompiling a header, are preprocessed locally first to send the
+  headers they include as well. Absolute paths in arguments are rewritten
+  relative to the working directory if they lie below it, files outside of
+  it (the toolchain, system headers) have to exist on the worker under the
+  same path.
+*/
+struct RemoteExecutor {
+  inline RemoteExecutor(std::string address) : _address(std::move(address)) {}
+  inline RemoteExecutor(const RemoteExecutor &) = delete;
+
+  inline backend::Result operator()(const std::vector<std::string> &command,
+                                    const Cobbler::Edges &edges) {
+    std::vector<std::filesystem::path> paths = edges.inputs;
+    if (_compiles(command)) {
+      backend::Result scan = _scanHeaders(command, paths);
+      if (scan.exitCode != 0) {
+        return scan;
+      }
+    }
+    std::vector<_Input> inputs = {};
+    for (const auto &path : paths) {
+      auto input = _describe(path);
+      if (input && std::none_of(inputs.begin(), inputs.end(),
+                                [&input](const _Input &i) {
+                                  return i.relative == input->relative;
+                                })) {
+        inputs.push_back(std::move(input.value()));
+      }
+    }
+    std::vector<std::string> outputs = {};
+    for (const auto &path : edges.outputs) {
+      auto relative = _relative(path);
+      if (!relative) {
+        return _fail(command, "output " + path.string() +
+                                  " is outside of the working directory");
+      }
+      outputs.push_back(relative->string());
+    }
+
+    int fd = remote::openSocket(_address, false);
+    if (fd < 0) {
+      return _fail(command,
+                   "could not connect to " + _address + ": " + strerror(errno));
+    }
+    remote::Channel channel = {fd};
+    std::vector<std::string> call = {};
+    for (const auto &arg : command) {
+      call.push_back(_rewrite(arg));
+    }
+    channel.putStrings(call);
+    channel.put(uint32_t(inputs.size()));
+    for (const _Input &input : inputs) {
+      channel.putString(input.relative);
+      channel.putString(input.hash);
+      channel.put(input.mode);
+    }
+    channel.putStrings(outputs);
+
+    for (const auto &hash : channel.getStrings()) {
+      auto it =
+          std::find_if(inputs.begin(), inputs.end(),
+                       [&hash](const _Input &i) { return i.hash == hash; });
+      std::ifstream file(it != inputs.end() ? it->path : "", std::ios::binary);
+      channel.putString(std::string(std::istreambuf_iterator<char>(file),
+                                    std::istreambuf_iterator<char>()));
+    }
+
+    backend::Result result = {};
+    result.exitCode = int32_t(channel.get<uint32_t>());
+    result.output = channel.getString();
+    result.userTime = channel.getDouble();
+    result.systemTime = channel.getDouble();
+    result.maxRss = long(int64_t(channel.get<uint64_t>()));
+    result.measured = true;
+    for (const auto &output : outputs) {
+      bool present = channel.get<uint8_t>() != 0;
+      mode_t mode = channel.get<uint32_t>();
+      std::string content = channel.getString();
+      if (channel.ok && present) {
+        int error = backend::writeFile(output, content);
+        if (error != 0) {
+          close(fd);
+          return _fail(command, "could not write " + output + ": " +
+                                    strerror(error));
+        }
+        chmod(output.c_str(), mode);
+      }
+    }
+    close(fd);
+    if (!channel.ok) {
+      return _fail(command, "lost connection to " + _address);
+    }
+    return result;
+  }
+
+private:
+  struct _Input {
+    std::string path;
+    std::string relative;
+    std::string hash;
+    uint32_t mode;
+    int64_t mtime;
+    uint64_t size;
+  };
+
+  static inline std::optional<std::filesystem::path>
+  _relative(const std::filesystem::path &path) {
+    std::error_code ec;
+    std::filesystem::path relative =
+        std::filesystem::absolute(path, ec)
+            .lexically_normal()
+            .lexically_relative(std::filesystem::current_path(ec));
+    if (ec || !remote::isContained(relative)) {
+      return {};
+    }
+    return relative;
+  }
+
+  // Relative to the working directory if path is absolute and below it
+  static inline std::string _relativePath(const std::string &path) {
+    if (path.empty() || path.front() != '/') {
+      return path;
+    }
+    auto relative = _relative(path);
+    return relative ? relative->string() : path;
+  }
+
+  // Rewrites a path given as the argument, after '=' or after a short flag
+  static inline std::string _rewrite(const std::string &arg) {
+    size_t start = 0;
+    if (arg.size() > 2 && arg[0] == '-' && arg[2] == '/') {
+      start = 2;
+    } else if (size_t equals = arg.find('=');
+               arg.starts_with("-") && equals != std::string::npos) {
+      start = equals + 1;
+    }
+    return arg.substr(0, start) + _relativePath(arg.substr(start));
+  }
+
+  static inline bool _compiles(const std::vector<std::string> &command) {
+    for (size_t i = 0; i < command.size(); i++) {
+      if (command[i] == "-c" ||
+          (command[i] == "-x" && i + 1 < command.size() &&
+           command[i + 1].ends_with("-header"))) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /*
+    Adds the headers command includes to inputs, as listed by the compiler
+    when command runs with "-M" instead of "-c" and without its outputs.
+    Returns the result of that run, its output captured.
+  */
+  inline backend::Result
+  _scanHeaders(const std::vector<std::string> &command,
+               std::vector<std::filesystem::path> &inputs) {
+    std::string depfile =
+        (std::filesystem::temp_directory_path() / "cobbler-scan-XXXXXX")
+            .string();
+    int fd = mkstemp(depfile.data());
+    if (fd < 0) {
+      return _fail(command, std::string("could not create a depfile: ") +
+                                strerror(errno));
+    }
+    close(fd);
+    std::vector<std::string> scan = {};
+    for (size_t i = 0; i < command.size(); i++) {
+      const std::string &arg = command[i];
+      if (arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ") {
+        i++;
+      } else if (arg != "-c" && arg != "-MD" && arg != "-MMD" &&
+                 !(arg.starts_with("-o") && arg.size() > 2)) {
+        scan.push_back(arg);
+      }
+    }
+    scan.insert(scan.end(), {"-M", "-MF", depfile});
+    backend::Result result = {};
+    backend::callAsync(
+        scan, [&result](const backend::Result &r) { result = r; }, true)
+        .wait();
+    auto headers = readDepfile(depfile);
+    unlink(depfile.c_str());
+    if (result.exitCode == 0 && !headers) {
+      return _fail(command, "could not read the headers it includes");
+    }
+    if (headers) {
+      inputs.insert(inputs.end(), headers->begin(), headers->end());
+    }
+    return result;
+  }
+
+  // Hashes of inputs are reused while their mtime and size are unchanged
+  inline std::optional<_Input> _describe(const std::filesystem::path &path) {
+    auto relative = _relative(path);
+    struct stat st;
+    if (!relative || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+      return {};
+    }
+    _Input input = {};
+    input.path = path.string();
+    input.relative = relative->string();
+    input.mode = uint32_t(st.st_mode & 07777);
+    input.mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    input.size = uint64_t(st.st_size);
+    {
+      std::scoped_lock lock(_mutex);
+      auto it = _known.find(input.path);
+      if (it != _known.end() && it->second.mtime == input.mtime &&
+          it->second.size == input.size) {
+        input.hash = it->second.hash;
+        return input;
+      }
+    }
+    input.hash = hashFile(path);
+    std::scoped_lock lock(_mutex);
+    _known[input.path] = input;
+    return input;
+  }
+
+  inline backend::Result _fail(const std::vector<std::string> &command,
+                               const std::string &reason) {
+    COBBLER_ERROR("Remote execution of %s failed: %s",
+                  command.front().c_str(), reason.c_str());
+    return {.exitCode = 127};
+  }
+
+  std::string _address;
+  std::mutex _mutex;
+  std::unordered_map<std::string, _Input> _known;
+};
+
+// Used by executeRemotely, e.g. remoteExecutor.emplace("unix:/tmp/worker")
+inline std::optional<RemoteExecutor> remoteExecutor;
+
+// Runs the spawned commands of c on the worker listening on address
+inline void executeRemotely(Cobbler &c, const std::string &address) {
+  RemoteExecutor *executor = &remoteExecutor.emplace(address);
+  c.executor([executor](const std::vector<std::string> &command,
+                        const Cobbler::Edges &edges) {
+    return (*executor)(command, edges);
+  });
+}
+
+/*
+  Serves RemoteExecutor clients, each connection on a thread of its own
+  with at most jobs commands running at once. Inputs are stored under
+  root/store by hash, commands run in scratch directories under root/work
+  which are removed once the outputs were sent back. Runs whatever command
+  a client sends without authentication, see the protocol above.
+*/
+struct Worker {
+  inline Worker(std::filesystem::path root,
+                unsigned jobs = backend::defaultJobCount())
+      : _root(std::move(root)), _slots(jobs) {
+    std::filesystem::create_directories(_root / "store");
+    std::filesystem::create_directories(_root / "work");
+  }
+  inline Worker(const Worker &) = delete;
+
+  [[noreturn]] inline void serve(const std::string &address) {
+    int listener = remote::openSocket(address, true);
+    if (listener < 0) {
+      COBBLER_ERROR("Could not listen on %s: %s", address.c_str(),
+                    strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    COBBLER_LOG("Worker listening on %s", address.c_str());
+    while (true) {
+      int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        COBBLER_ERROR("Could not accept a connection: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+      std::thread([this, fd]() {
+        try {
+          _serve(fd);
+        } catch (const std::exception &e) {
+          COBBLER_WARN("Dropping connection: %s", e.what());
+        }
+        close(fd);
+      }).detach();
+    }
+  }
+
+private:
+  inline std::filesystem::path _blob(const std::string &hash) const {
+    return _root / "store" / hash.substr(0, 2) / hash.substr(2);
+  }
+
+  static inline bool _isHash(const std::string &hash) {
+    return hash.size() == 64 &&
+           std::all_of(hash.begin(), hash.end(), [](char c) {
+             return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+           });
+  }
+
+  inline void _serve(int fd) {
+    remote::Channel channel = {.fd = fd,
+                               .maxCount = _maxCount,
+                               .maxString = _maxString};
+    std::vector<std::string> command = channel.getStrings();
+    struct Input {
+      std::string path;
+      std::string hash;
+      uint32_t mode;
+    };
+    std::vector<Input> inputs = {};
+    uint32_t inputCount = channel.getCount();
+    for (uint32_t i = 0; i < inputCount && channel.ok; i++) {
+      Input input = {};
+      input.path = channel.getString();
+      input.hash = channel.getString();
+      input.mode = channel.get<uint32_t>();
+      inputs.push_back(std::move(input));
+    }
+    std::vector<std::string> outputs = channel.getStrings();
+    bool valid = channel.ok && !command.empty();
+    for (const Input &input : inputs) {
+      valid = valid && remote::isContained(input.path) && _isHash(input.hash);
+    }
+    for (const auto &output : outputs) {
+      valid = valid && remote::isContained(output);
+    }
+    if (!valid) {
+      COBBLER_WARN("Dropping malformed request");
+      return;
+    }
+
+    std::vector<std::string> missing = {};
+    std::error_code ec;
+    for (const Input &input : inputs) {
+      if (!std::filesystem::exists(_blob(input.hash), ec) &&
+          std::find(missing.begin(), missing.end(), input.hash) ==
+              missing.end()) {
+        missing.push_back(input.hash);
+      }
+    }
+    channel.putStrings(missing);
+    channel.maxString = _maxBlob;
+    for (const auto &hash : missing) {
+      std::string content = channel.getString();
+      Hasher h;
+      h.update(content.data(), content.size());
+      if (!channel.ok || h.hex() != hash || !_store(hash, content)) {
+        COBBLER_WARN("Could not store input %s", hash.c_str());
+        return;
+      }
+    }
+
+    std::string scratch = (_root / "work" / "XXXXXX").string();
+    if (!mkdtemp(scratch.data())) {
+      COBBLER_ERROR("Could not create a scratch directory: %s",
+                    strerror(errno));
+      return;
+    }
+    for (const Input &input : inputs) {
+      std::filesystem::path target = std::filesystem::path(scratch) /
+                                     input.path;
+      if (backend::copyFile(_blob(input.hash), target) == 0) {
+        chmod(target.c_str(), input.mode);
+      }
+    }
+    for (const auto &output : outputs) {
+      backend::makeDirectory(
+          (std::filesystem::path(scratch) / output).parent_path());
+    }
+
+    // Spawned through sh to change into the scratch directory, as threads
+    // of this process share a working directory
+    std::vector<std::string> call = {"sh", "-c", "cd \"$0\" && exec \"$@\"",
+                                     scratch};
+    call.insert(call.end(), command.begin(), command.end());
+    backend::Result result = {};
+    _slots.acquire();
+    COBBLER_LOG("Executing remote command: %s", command.front().c_str());
+    backend::callAsync(
+        call, [&result](const backend::Result &r) { result = r; }, true)
+        .wait();
+    _slots.release();
+
+    channel.put(uint32_t(result.exitCode));
+    channel.putString(result.output);
+    channel.putDouble(result.userTime);
+    channel.putDouble(result.systemTime);
+    channel.put(uint64_t(int64_t(result.maxRss)));
+    for (const auto &output : outputs) {
+      std::filesystem::path path = std::filesystem::path(scratch) / output;
+      struct stat st;
+      bool present = stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+      std::ifstream file(present ? path : "", std::ios::binary);
+      channel.put(uint8_t(present));
+      channel.put(uint32_t(present ? st.st_mode & 07777 : 0));
+      channel.putString(std::string(std::istreambuf_iterator<char>(file),
+                                    std::istreambuf_iterator<char>()));
+    }
+    backend::removePath(scratch);
+  }
+
+  // Written next to the blob and renamed, as connections may race on it
+  inline bool _store(const std::string &hash, const std::string &content) {
+    static std::atomic_uint64_t counter = 0;
+    std::filesystem::path blob = _blob(hash);
+    std::error_code ec;
+    std::filesystem::create_directories(blob.parent_path(), ec);
+    std::string tmp = blob.string() + ".tmp." + std::to_string(counter++);
+    {
+      std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+      if (!file.write(content.data(), content.size()).flush()) {
+        unlink(tmp.c_str());
+        return false;
+      }
+    }
+    return rename(tmp.c_str(), blob.c_str()) == 0;
+  }
+
+  // Limits of a request, beyond which the connection is closed
+  static constexpr uint32_t _maxCount = 1 << 16;
+  static constexpr uint64_t _maxString = 1 << 16;
+  static constexpr uint64_t _maxBlob = uint64_t(1) << 30;
+
+  std::filesystem::path _root;
+  std::counting_semaphore<> _slots;
+};
+
+} // namespace util
+} // namespace cbl
+#endif // !COBBLER_REMOTE_H
@@ -1,5 +1,11 @@
-#pragma once
+#ifndef COBBLER_UTIL_H
+#define COBBLER_UTIL_H
 #include "../cobbler.h"
+#include "cache.h"
+#include "db.h"
+#include "depfile.h"
+#include "remote.h"
+#include "watch.h"
 #include <algorithm>
 #include <fstream>
 #include <functional>
@@ -337,6 +343,25 @@ struct ArgParser {
     return *this;
   }
 
+  // Registers "--jobs"/"-j" to set the job limit of the given Cobbler
+  inline ArgParser &jobs(Cobbler &c) {
+    return opt_value(
+        [this, &c](const std::string &v) {
+          // strtoul skips whitespace and wraps negative numbers around
+          char *end = nullptr;
+          errno = 0;
+          unsigned long n = strtoul(v.c_str(), &end, 10);
+          if (v.empty() || !isdigit(uint8_t(v.front())) || *end != '\0' ||
+              errno == ERANGE || n == 0 ||
+              n > std::numeric_limits<unsigned>::max()) {
+            _error("--jobs", "expected a positive integer");
+          }
+          c.jobs(n);
+        },
+        std::to_string(c.jobs()), "--jobs", "-j",
+        "maximum number of concurrently running commands");
+  }
+
 private:
   void _error(const std::string &token, const std::string &reason) {
     COBBLER_ERROR("Incorrect argument \"%s\" : %s", token.c_str(),
@@ -448,38 +473,388 @@ private:
   std::string _name;
 };
 
-template <io TYPE = io::async, typename... S>
-inline std::filesystem::path
-compile(Cobbler &c, const std::filesystem::path &unit,
-        const std::filesystem::path &targetPath, const S &...extraFlags) {
+// True if target is missing, or if any input is missing or newer than it
+inline bool isOutdated(const std::filesystem::path &target,
+                       const std::vector<std::filesystem::path> &inputs) {
+  backend::FileStat out = backend::statCache.get(target);
+  if (!out.exists) {
+    return true;
+  }
+  for (const backend::FileStat &in : backend::statCache.get(inputs)) {
+    if (!in.exists || in.mtime > out.mtime) {
+      return true;
+    }
+  }
+  return false;
+}
 
-  COBBLER_LOG("Compiling unit: %s", unit.string().c_str());
-  c.cmd<TYPE>("c++", "-c", unit.string(), "-o",
-              (targetPath / (unit.stem().string() + ".o")).string(),
-              extraFlags...);
+// A header set compiled by util::precompile, passed on to util::compile
+struct PrecompiledHeader {
+  // Includes every header of the set, passed to the compiler with -include
+  std::filesystem::path header;
+  std::filesystem::path output;
+};
+
+/*
+  Compiles headers into a precompiled header in targetPath, to be passed to
+  util::compile for the units using it. The header is only rebuilt if one
+  of the headers, anything they include, or flags changed. Units should be
+  compiled with the same flags, otherwise the compiler ignores the
+  precompiled header and parses the headers as usual.
+*/
+template <io TYPE = io::async>
+inline PrecompiledHeader
+precompile(Cobbler &c, const std::vector<std::filesystem::path> &headers,
+           const std::filesystem::path &targetPath,
+           const std::vector<std::string> &flags) {
+  std::filesystem::create_directories(targetPath);
+  std::filesystem::path header = targetPath / "cobbler_pch.h";
+  std::filesystem::path output = header.string() + ".gch";
+  std::filesystem::path depfile = depfileFor(output);
+  std::filesystem::path stamp = output.string() + ".flags";
+
+  // Relative to the header, to resolve in scratch directories of workers
+  std::filesystem::path base =
+      std::filesystem::absolute(targetPath).lexically_normal();
+  std::string content = {};
+  for (const auto &h : headers) {
+    std::filesystem::path relative =
+        std::filesystem::absolute(h).lexically_normal().lexically_relative(
+            base);
+    content += "#include \"" + relative.string() + "\"\n";
+  }
+  std::string flagLine = {};
+  for (const auto &flag : flags) {
+    flagLine += flag + "\n";
+  }
+  auto readAll = [](const std::filesystem::path &p) {
+    std::ifstream file(p);
+    return std::string((std::istreambuf_iterator<char>(file)),
+                       std::istreambuf_iterator<char>());
+  };
+  c.generated(header).generated(stamp);
+  // Only touched on changes, it is an input of every unit
+  if (readAll(header) != content) {
+    std::ofstream(header) << content;
+    backend::statCache.invalidate(header);
+  }
+  PrecompiledHeader pch = {.header = header, .output = output};
+
+  std::vector<std::filesystem::path> inputs = {header};
+  auto dependencies = readDepfile(depfile);
+  if (dependencies && readAll(stamp) == flagLine) {
+    inputs.insert(inputs.end(), dependencies->begin(), dependencies->end());
+    if (!isOutdated(output, inputs)) {
+      COBBLER_LOG("Precompiled header up to date: %s",
+                  output.string().c_str());
+      return pch;
+    }
+  }
 
-  return (targetPath / unit.stem()).string() + ".o";
+  COBBLER_LOG("Precompiling header: %s", output.string().c_str());
+  std::vector<std::string> command = {
+      "c++", "-x",  "c++-header",     header.string(), "-o", output.string(),
+      "-MMD", "-MF", depfile.string(), "-MT",           output.string()};
+  command.insert(command.end(), flags.begin(), flags.end());
+
+  // The flags are recorded only once the header was built with them
+  auto h = c.job<TYPE>({.inputs = inputs, .outputs = {output, depfile}},
+                       command);
+  c.intercept(h, {}, [stamp, flagLine](const backend::Result &result) {
+    if (result.exitCode == 0) {
+      std::ofstream(stamp) << flagLine;
+    }
+  });
+  return pch;
 }
 
+template <io TYPE = io::async, typename... S>
+inline PrecompiledHeader
+precompile(Cobbler &c, const std::vector<std::filesystem::path> &headers,
+           const std::filesystem::path &targetPath, const S &...flags) {
+  return precompile<TYPE>(c, headers, targetPath,
+                          backend::splatVariadicToArgVector(flags...));
+}
+
+// Pool tag of util::compile and util::link, see Cobbler::pool
+struct Pool {
+  std::string name = {};
+};
+
+/*
+  Compiles unit into targetPath, skipping it if neither the unit nor any
+  header recorded in its depfile changed since the object was built. The
+  headers are declared as inputs of the command, so headers generated by
+  other commands are ordered before it. Goes through util::objectCache
+  when it is set, and includes pch when it is given.
+*/
 template <io TYPE = io::async>
 inline std::filesystem::path
 compile(Cobbler &c, const std::filesystem::path &unit,
         const std::filesystem::path &targetPath,
-        const std::vector<std::string> &extraFlags) {
+        const std::vector<std::string> &extraFlags, const Pool &pool = {},
+        const std::optional<PrecompiledHeader> &pch = {}) {
+  std::filesystem::path object = (targetPath / unit.stem()).string() + ".o";
+  std::filesystem::path depfile = depfileFor(object);
 
-  COBBLER_LOG("Compiling unit: %s", unit.string().c_str());
   std::vector<std::string> command;
   command.push_back("c++");
   command.push_back("-c");
   command.push_back(unit.string());
   command.push_back("-o");
-  command.push_back((targetPath / (unit.stem().string() + ".o")).string());
+  command.push_back(object.string());
+  command.push_back("-MMD");
+  command.push_back("-MF");
+  command.push_back(depfile.string());
+  command.push_back("-MT");
+  command.push_back(object.string());
+  if (pch) {
+    command.push_back("-include");
+    command.push_back(pch->header.string());
+  }
 
   command.insert(command.end(), extraFlags.begin(), extraFlags.end());
 
-  c.cmd<TYPE>(command);
+  std::vector<std::filesystem::path> inputs = {unit};
+  if (pch) {
+    inputs.push_back(pch->output);
+  }
+  auto headers = readDepfile(depfile);
+  if (headers) {
+    inputs.insert(inputs.end(), headers->begin(), headers->end());
+  }
+  // Inputs still to be generated by c are not known to be up to date
+  bool generated = std::any_of(
+      inputs.begin(), inputs.end(),
+      [&c](const std::filesystem::path &p) { return c.producer(p); });
+  bool upToDate = false;
+  if (!generated && buildDb) {
+    upToDate = !buildDb->isDirty(object, command);
+  } else if (!generated && headers) {
+    upToDate = !isOutdated(object, inputs);
+  }
+  if (upToDate) {
+    COBBLER_LOG("Unit up to date: %s", unit.string().c_str());
+    return object;
+  }
+
+  COBBLER_LOG("Compiling unit: %s", unit.string().c_str());
+  Cobbler::Edges edges = {.inputs = inputs, .outputs = {object, depfile}};
+  Cobbler::Handle h = c.job<TYPE>(edges, command);
+  if (objectCache) {
+    // The compiler still runs as a spawned command on a miss
+    ObjectCache *cache = &objectCache.value();
+    auto key = std::make_shared<std::string>();
+    c.intercept(
+        h,
+        [cache, command, object, key]() -> std::optional<backend::Result> {
+          auto [found, restored] = cache->lookup(command, object);
+          *key = found;
+          if (restored) {
+            return backend::Result{};
+          }
+          return {};
+        },
+        [cache, object, key](const backend::Result &result) {
+          if (result.exitCode == 0) {
+            cache->store(*key, object);
+          }
+        });
+  }
+  if (!pool.name.empty()) {
+    c.usePool(h, pool.name);
+  }
+  if (generated && (buildDb || headers)) {
+    // Generators declared with Cobbler::restat may leave inputs unchanged
+    BuildDb *db = buildDb ? &buildDb.value() : nullptr;
+    c.upToDate(h, [db, command, object, inputs]() {
+      return db ? !db->isDirty(object, command) : !isOutdated(object, inputs);
+    });
+  }
+
+  if (buildDb) {
+    // The depfile written by this compile names the headers to record
+    BuildDb *db = &buildDb.value();
+    c.onSuccess(h, [db, command, object, depfile, unit, pch]() {
+      std::vector<std::filesystem::path> inputs = {unit};
+      if (pch) {
+        inputs.push_back(pch->output);
+      }
+      auto headers = readDepfile(depfile);
+      if (headers) {
+        inputs.insert(inputs.end(), headers->begin(), headers->end());
+      }
+      db->record(object, command, inputs);
+    });
+  }
+
+  return object;
+}
+
+template <io TYPE = io::async, typename... S>
+inline std::filesystem::path
+compile(Cobbler &c, const std::filesystem::path &unit,
+        const std::filesystem::path &targetPath, const S &...extraFlags) {
+  return compile<TYPE>(c, unit, targetPath,
+                       backend::splatVariadicToArgVector(extraFlags...));
+}
+
+template <io TYPE = io::async, typename... S>
+inline std::filesystem::path
+compile(Cobbler &c, const PrecompiledHeader &pch,
+        const std::filesystem::path &unit,
+        const std::filesystem::path &targetPath, const S &...extraFlags) {
+  return compile<TYPE>(c, unit, targetPath,
+                       backend::splatVariadicToArgVector(extraFlags...), {},
+                       pch);
+}
+
+struct UnityOptions {
+  // Upper bound on the units per group
+  size_t maxUnits = 8;
+  // Upper bound on the summed source size of a group, 0 for no limit
+  uintmax_t maxBytes = 0;
+  // Units compiled on their own, e.g. the ones currently being edited
+  std::vector<std::filesystem::path> standalone = {};
+  // Prefix of the generated unity sources in targetPath
+  std::string name = "unity";
+  // Included by every group and standalone unit, see util::precompile
+  std::optional<PrecompiledHeader> precompiledHeader = {};
+};
+
+/*
+  Groups units into unity translation units and compiles each group through
+  util::compile, returning the objects to link. Units are ordered by a hash
+  of their path, and a group ends after a unit whose hash is a multiple of
+  options.maxUnits, or once options.maxUnits or options.maxBytes would be
+  exceeded. Groups are named after their first unit. Adding, removing or
+  moving a unit to options.standalone therefore only regroups the units
+  next to it, and a generated unity source is only rewritten when its
+  group changed. So an edit recompiles the group of the edited unit only.
+*/
+template <io TYPE = io::async>
+inline std::vector<std::filesystem::path>
+compileUnity(Cobbler &c, const std::vector<std::filesystem::path> &units,
+             const std::filesystem::path &targetPath,
+             const UnityOptions &options,
+             const std::vector<std::string> &extraFlags,
+             const Pool &pool = {}) {
+  std::vector<std::filesystem::path> objects = {};
+  std::vector<std::pair<std::string, std::filesystem::path>> grouped = {};
+  for (const auto &unit : units) {
+    bool standalone = std::any_of(options.standalone.begin(),
+                                  options.standalone.end(),
+                                  [&unit](const std::filesystem::path &s) {
+                                    std::error_code ec;
+                                    return std::filesystem::equivalent(s, unit,
+                                                                       ec);
+                                  });
+    if (standalone) {
+      objects.push_back(compile<TYPE>(c, unit, targetPath, extraFlags, pool,
+                                      options.precompiledHeader));
+    } else {
+      std::filesystem::path path =
+          std::filesystem::absolute(unit).lexically_normal();
+      grouped.push_back({Hasher().update(path.string()).hex(), path});
+    }
+  }
+  std::sort(grouped.begin(), grouped.end());
+
+  size_t perGroup = std::max<size_t>(1, options.maxUnits);
+  std::vector<std::pair<std::string, std::vector<std::filesystem::path>>>
+      groups = {};
+  bool closed = true;
+  uintmax_t groupBytes = 0;
+  for (const auto &[hash, unit] : grouped) {
+    std::string prefix = hash.substr(0, 16);
+    std::error_code ec;
+    uintmax_t bytes = std::filesystem::file_size(unit, ec);
+    if (ec) {
+      bytes = 0;
+    }
+    if (!closed && options.maxBytes > 0 &&
+        groupBytes + bytes > options.maxBytes) {
+      closed = true;
+    }
+    if (closed) {
+      groups.push_back({prefix, {}});
+      groupBytes = 0;
+      closed = false;
+    }
+    groups.back().second.push_back(unit);
+    groupBytes += bytes;
+    closed = groups.back().second.size() >= perGroup ||
+             strtoull(prefix.c_str(), nullptr, 16) % perGroup == 0;
+  }
 
-  return (targetPath / unit.stem()).string() + ".o";
+  std::filesystem::create_directories(targetPath);
+  for (const auto &[name, group] : groups) {
+    std::filesystem::path source =
+        targetPath / (options.name + "_" + name + ".cpp");
+    c.generated(source);
+    std::string content = "// Generated by cobbler, do not edit\n";
+    for (const auto &unit : group) {
+      content += "#include \"" + unit.string() + "\"\n";
+    }
+    std::ifstream existing(source);
+    std::string previous((std::istreambuf_iterator<char>(existing)),
+                         std::istreambuf_iterator<char>());
+    if (previous != content) {
+      std::ofstream(source) << content;
+      backend::statCache.invalidate(source);
+    }
+    objects.push_back(compile<TYPE>(c, source, targetPath, extraFlags, pool,
+                                    options.precompiledHeader));
+  }
+  return objects;
+}
+
+template <io TYPE = io::async, typename... S>
+inline std::vector<std::filesystem::path>
+compileUnity(Cobbler &c, const std::vector<std::filesystem::path> &units,
+             const std::filesystem::path &targetPath,
+             const UnityOptions &options, const S &...extraFlags) {
+  return compileUnity<TYPE>(c, units, targetPath, options,
+                            backend::splatVariadicToArgVector(extraFlags...));
+}
+
+/*
+  Adds the link command, unless util::buildDb knows target to be built by
+  the same command from the same objects and none of them is rebuilt by c.
+*/
+template <io TYPE = io::async>
+inline void _linkJob(Cobbler &c,
+                     const std::vector<std::filesystem::path> &objects,
+                     const std::filesystem::path &target,
+                     const std::vector<std::string> &command,
+                     const Pool &pool = {}) {
+  bool rebuilt = false;
+  if (buildDb) {
+    rebuilt = std::any_of(objects.begin(), objects.end(),
+                          [&c](const std::filesystem::path &p) {
+                            return c.producer(p);
+                          });
+    if (!rebuilt && !buildDb->isDirty(target, command)) {
+      COBBLER_LOG("Target up to date: %s", target.string().c_str());
+      return;
+    }
+  }
+  auto h = c.job<TYPE>({.inputs = objects, .outputs = {target}}, command);
+  if (!pool.name.empty()) {
+    c.usePool(h, pool.name);
+  }
+  if (buildDb) {
+    BuildDb *db = &buildDb.value();
+    if (rebuilt) {
+      // Objects compiled under Cobbler::restat may come out identical
+      c.upToDate(h, [db, command, target]() {
+        return !db->isDirty(target, command);
+      });
+    }
+    c.onSuccess(h, [db, command, objects, target]() {
+      db->record(target, command, objects);
+    });
+  }
 }
 
 template <io TYPE = io::async, typename... S>
@@ -497,13 +872,14 @@ inline void link(Cobbler &c, const std::vector<std::filesystem::path> &objects,
   command.push_back(target.string());
   auto rrg = backend::splatVariadicToArgVector(extraFlags...);
   command.insert(command.end(), rrg.begin(), rrg.end());
-  c.cmd<TYPE>(command);
+  _linkJob<TYPE>(c, objects, target, command);
 }
 
 template <io TYPE = io::async>
 inline void link(Cobbler &c, const std::vector<std::filesystem::path> &objects,
                  const std::filesystem::path &target,
-                 const std::vector<std::string> &extraFlags) {
+                 const std::vector<std::string> &extraFlags,
+                 const Pool &pool = {}) {
   std::vector<std::string> command = {};
   command.push_back("c++");
 
@@ -515,13 +891,14 @@ inline void link(Cobbler &c, const std::vector<std::filesystem::path> &objects,
   command.push_back("-o");
   command.push_back(target.string());
   command.insert(command.end(), extraFlags.begin(), extraFlags.end());
-  c.cmd<TYPE>(command);
+  _linkJob<TYPE>(c, objects, target, command, pool);
 }
 
+// True if a is newer than b or b is missing
 inline bool isNewerThan(const std::filesystem::path &a,
                         const std::filesystem::path &b) {
-  return std::filesystem::last_write_time(a) >
-         std::filesystem::last_write_time(b);
+  backend::FileStat older = backend::statCache.get(b);
+  return !older.exists || backend::statCache.get(a).mtime > older.mtime;
 }
 
 inline void run(std::filesystem::path target, const char **argv) {
@@ -534,6 +911,43 @@ inline void run(std::filesystem::path target, const char **argv) {
   exit(EXIT_FAILURE);
 }
 
+/*
+  Directory holding cobbler.h as included by units. __FILE__ is spelled the
+  way the compiler found this header, relative to the directory of the
+  script or to wherever it was compiled from if it was included by a
+  relative path.
+*/
+inline std::optional<std::filesystem::path>
+_includeDirectory(const std::vector<std::filesystem::path> &units) {
+  std::filesystem::path included =
+      std::filesystem::path(__FILE__).parent_path().parent_path();
+  std::vector<std::filesystem::path> candidates = {};
+  if (included.is_absolute()) {
+    candidates.push_back(included);
+  } else {
+    for (const auto &unit : units) {
+      candidates.push_back(unit.parent_path() / included);
+    }
+    candidates.push_back(std::filesystem::current_path() / included);
+  }
+  for (const auto &candidate : candidates) {
+    std::filesystem::path dir = candidate.lexically_normal();
+    std::error_code ec;
+    if (std::filesystem::exists(dir / "cobbler.h", ec) &&
+        std::filesystem::exists(dir / "cobbler" / "util.h", ec)) {
+      return dir;
+    }
+  }
+  return {};
+}
+
+/*
+  Rebuilds the build script from units into target and restarts it with
+  argv. Objects, depfiles and a util::BuildDb are kept in a .cobbler
+  directory next to target, so only units whose content or flags changed
+  are recompiled and target is only relinked when an object changed. Exits
+  instead of restarting when a step fails.
+*/
 template <typename... S>
 inline void rebuildAndRun(Cobbler &c, std::vector<std::filesystem::path> units,
                           std::filesystem::path target, const char **argv,
@@ -555,23 +969,50 @@ inline void rebuildAndRun(Cobbler &c, std::vector<std::filesystem::path> units,
   COBBLER_LOG("Compiling unit(s)");
 
   COBBLER_PUSH_INDENT();
+  // Objects are kept between rebuilds, only changed units are recompiled
+  std::filesystem::path objectDir = target.parent_path() / ".cobbler";
+  std::filesystem::create_directories(objectDir);
+  if (!buildDb) {
+    buildDb.emplace(objectDir / "build.db");
+  }
+  // Every build script includes cobbler itself, keep it precompiled
+  std::optional<PrecompiledHeader> pch = {};
+  if (auto includeDir = _includeDirectory(units)) {
+    pch = util::precompile(
+        c, {*includeDir / "cobbler.h", *includeDir / "cobbler" / "util.h"},
+        objectDir, extraFlags...);
+  }
   std::vector<std::filesystem::path> objects = {};
   for (const auto &unit : units) {
-    objects.push_back(
-        util::compile(c, unit, target.parent_path(), extraFlags...));
+    objects.push_back(util::compile(
+        c, unit, objectDir, backend::splatVariadicToArgVector(extraFlags...),
+        {}, pch));
   }
   c();
   COBBLER_POP_INDENT();
+  if (!c.failures().empty()) {
+    COBBLER_ERROR("Failed to rebuild %s", target.c_str());
+    exit(EXIT_FAILURE);
+  }
   c.clear();
 
   COBBLER_LOG("Linking object(s)...")
   COBBLER_PUSH_INDENT();
   util::link<io::sync>(c, objects, target);
-  for (const auto &unit : units) {
-    c.cmd("rm", (unit.stem().string() + ".o"));
+  if (c.producer(target)) {
+    c();
+  } else {
+    // Settles the staleness check of the caller when a unit was only touched
+    std::error_code ec;
+    std::filesystem::last_write_time(
+        target, std::filesystem::file_time_type::clock::now(), ec);
+    backend::statCache.invalidate(target);
   }
-  c();
   COBBLER_POP_INDENT();
+  if (!c.failures().empty()) {
+    COBBLER_ERROR("Failed to link %s", target.c_str());
+    exit(EXIT_FAILURE);
+  }
 
   COBBLER_LOG("Restarting program %s", target.c_str());
   COBBLER_POP_INDENT();
@@ -585,3 +1026,4 @@ inline void rebuildAndRun(Cobbler &c, std::vector<std::filesystem::path> units,
 
 } // namespace util
 } // namespace cbl
+#endif // !COBBLER_UTIL_H
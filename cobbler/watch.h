@@ -0,0 +1,200 @@
+#ifndef COBBLER_WATCH_H
+#define COBBLER_WATCH_H
+#include "../cobbler.h"
+#include <poll.h>
+#include <sys/inotify.h>
+
+namespace cbl {
+namespace util {
+
+// Recursively watches directories for modified, created and removed files
+struct FileWatcher {
+  using Ignore = std::function<bool(const std::filesystem::path &)>;
+
+  inline FileWatcher(const std::vector<std::filesystem::path> &roots) {
+    _fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (_fd < 0) {
+      COBBLER_ERROR("Could not initialize inotify: %s", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    for (const auto &root : roots) {
+      add(std::filesystem::absolute(root).lexically_normal());
+    }
+  }
+  inline FileWatcher(const FileWatcher &) = delete;
+  ~FileWatcher() noexcept { close(_fd); }
+
+  // Watches dir and every directory below it, hidden ones excluded
+  inline void add(const std::filesystem::path &dir) {
+    int wd = inotify_add_watch(_fd, dir.c_str(), _mask);
+    if (wd < 0) {
+      COBBLER_WARN("Could not watch %s: %s", dir.c_str(), strerror(errno));
+      return;
+    }
+    _dirs[wd] = dir;
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+      if (entry.is_directory(ec) && !entry.is_symlink(ec) &&
+          !_hidden(entry.path())) {
+        add(entry.path());
+      }
+    }
+  }
+
+  /*
+    Waits up to timeout, forever if negative, for a change of a file not
+    matched by ignore. Returns false on timeout or once wakeFd became
+    readable.
+  */
+  inline bool wait(std::chrono::milliseconds timeout, const Ignore &ignore,
+                   int wakeFd = -1) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true) {
+      int left = -1;
+      if (timeout.count() >= 0) {
+        left = std::max<long long>(
+            0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                   deadline - std::chrono::steady_clock::now())
+                   .count());
+      }
+      pollfd fds[2] = {{_fd, POLLIN, 0}, {wakeFd, POLLIN, 0}};
+      int n = poll(fds, wakeFd >= 0 ? 2 : 1, left);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0 || (wakeFd >= 0 && fds[1].revents)) {
+        return false;
+      }
+      if (_read(ignore)) {
+        return true;
+      }
+    }
+  }
+
+private:
+  static constexpr uint32_t _mask = IN_CLOSE_WRITE | IN_MOVED_TO |
+                                    IN_MOVED_FROM | IN_CREATE | IN_DELETE;
+
+  // Hidden files, editor backups and build directories like .cobbler
+  static inline bool _hidden(const std::filesystem::path &p) {
+    std::string name = p.filename().string();
+    return name.empty() || name.front() == '.' || name.back() == '~';
+  }
+
+  // Drains pending events, returns whether one of them is relevant
+  inline bool _read(const Ignore &ignore) {
+    alignas(inotify_event) char buffer[1 << 16];
+    bool changed = false;
+    ssize_t size;
+    while ((size = read(_fd, buffer, sizeof(buffer))) > 0) {
+      for (char *p = buffer; p < buffer + size;) {
+        auto *event = reinterpret_cast<inotify_event *>(p);
+        p += sizeof(inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+          changed = true;
+          continue;
+        }
+        if (event->mask & IN_IGNORED) {
+          _dirs.erase(event->wd);
+          continue;
+        }
+        auto dir = _dirs.find(event->wd);
+        if (dir == _dirs.end() || event->len == 0) {
+          continue;
+        }
+        std::filesystem::path path = dir->second / event->name;
+        if (_hidden(path) || ignore(path)) {
+          continue;
+        }
+        if ((event->mask & IN_ISDIR) &&
+            (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+          add(path);
+          // An empty directory, like one the build creates for its outputs
+          if (event->mask & IN_CREATE) {
+            continue;
+          }
+        }
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+  int _fd;
+  std::unordered_map<int, std::filesystem::path> _dirs;
+};
+
+struct WatchOptions {
+  // Directories watched recursively
+  std::vector<std::filesystem::path> roots = {"."};
+  // Quiet period after the last change before a rebuild starts
+  std::chrono::milliseconds debounce{100};
+};
+
+/*
+  Keeps rebuilding in this process instead of re-executing the build
+  script. describe adds the commands of one build to c, which is run and
+  described again whenever a file below options.roots changes. A change
+  during a run cancels the commands still in flight. State such as
+  util::buildDb, the object cache and the resolved executables stays warm
+  between runs. backend::statCache does not: every run clears it, as
+  commands may write files they do not declare, so each rebuild stats its
+  inputs again. Files the build writes itself, see Cobbler::writes, are
+  ignored.
+*/
+[[noreturn]] inline void watch(Cobbler &c,
+                               const std::function<void(Cobbler &)> &describe,
+                               const WatchOptions &options = {}) {
+  FileWatcher watcher(options.roots);
+  // Files the build writes itself and temporaries named after them
+  auto ignore = [&c](const std::filesystem::path &path) {
+    std::string p = path.string();
+    size_t tmp = p.find(".tmp");
+    if (tmp != std::string::npos &&
+        (tmp + 4 == p.size() || p[tmp + 4] == '.')) {
+      p.resize(tmp);
+    } else if (p.ends_with(".i")) {
+      p.resize(p.size() - 2);
+    }
+    return c.writes(path) || c.writes(p);
+  };
+  int finished = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  while (true) {
+    c.clear();
+    describe(c);
+    size_t runs = c.runs();
+    std::thread runner([&c, finished]() {
+      c();
+      uint64_t one = 1;
+      if (write(finished, &one, sizeof(one)) < 0) {
+        COBBLER_WARN("Could not signal end of run: %s", strerror(errno));
+      }
+    });
+    // A change is only looked for once the run can be cancelled
+    c.awaitRun(runs);
+    bool changed = watcher.wait(std::chrono::milliseconds(-1), ignore,
+                                finished);
+    if (changed) {
+      COBBLER_LOG("Change detected, cancelling run");
+      c.cancel();
+    }
+    runner.join();
+    uint64_t count;
+    while (read(finished, &count, sizeof(count)) > 0) {
+    }
+
+    if (!changed) {
+      COBBLER_LOG("Watching for changes...");
+      watcher.wait(std::chrono::milliseconds(-1), ignore);
+    }
+    // Lets a burst of writes, like a save of several files, settle first
+    while (watcher.wait(options.debounce, ignore)) {
+    }
+    COBBLER_LOG("Rebuilding...");
+  }
+}
+
+} // namespace util
+} // namespace cbl
+#endif // !COBBLER_WATCH_H
@@ -18,11 +18,12 @@ int main(int argc, const char **argv) {
 
   COBBLER_LOG("Copying headers!");
   COBBLER_PUSH_INDENT();
-  c.cmd("c++", "-fpreprocessed", "-dD", "-E", "-w", "./cobbler.h", "-o",
-        "/usr/local/include/cobbler.h");
-  c.cmd("mkdir", "-p", "/usr/local/include/cobbler/");
-  c.cmd("c++", "-fpreprocessed", "-dD", "-E", "-w", "./cobbler/util.h", "-o",
-        "/usr/local/include/cobbler/util.h");
+  c.copy("./cobbler.h", "/usr/local/include/cobbler.h");
+  for (const char *header : {"util.h", "hash.h", "cache.h", "db.h",
+                             "depfile.h", "remote.h", "watch.h"}) {
+    c.copy(std::string("./cobbler/") + header,
+           std::string("/usr/local/include/cobbler/") + header);
+  }
   c();
   COBBLER_POP_INDENT();
   COBBLER_LOG("Done!");
@@ -0,0 +1,29 @@
+#include "cobbler.h"
+#include "cobbler/util.h"
+#include <cstdlib>
+#include <filesystem>
+
+int main(int argc, const char **argv) {
+  cbl::Cobbler c;
+
+  if (cbl::util::isNewerThan("worker.cpp", "worker")) {
+    cbl::util::rebuildAndRun(c, {"worker.cpp"}, "worker", argv,
+                             "-std=c++20");
+  }
+
+  std::string address;
+  std::string root;
+  cbl::util::ArgParser parser(argc, argv, "worker");
+  parser
+      .opt_value(&address, "unix:/tmp/cobbler-worker.sock", "--listen", "-l",
+                 "unix:PATH or HOST:PORT to accept commands on, without "
+                 "authentication: never expose it to untrusted networks, "
+                 "an empty HOST listens on loopback only")
+      .opt_value(&root, "/tmp/cobbler-worker", "--root", "-r",
+                 "directory for stored inputs and scratch directories")
+      .jobs(c);
+  parser();
+
+  cbl::util::Worker worker(root, c.jobs());
+  worker.serve(address);
+}